@@ -61,4 +61,233 @@ typedef struct {
     unsigned char R;
 } Pixel;
 
+// Returns 1 if every pixel has R == G == B, so the image can be coded as Y only
+int is_grayscale(Pixel **pixels, int width, int height) {
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            Pixel p = pixels[i][j];
+            if (p.R != p.G || p.G != p.B) return 0;
+        }
+    }
+    return 1;
+}
+
+// Open BMP reader: parses headers and palette, pixel rows are read on demand
+typedef struct {
+    FILE *fp;
+    int width;
+    int height;
+    int bpp;
+    int bottom_up;
+    int stride;             // bytes per stored row, including padding
+    long data_offset;
+    long pos;               // current file position, avoids redundant seeks
+    int gray_palette;       // 8-bit file whose palette is all gray
+    Pixel palette[256];
+    unsigned char *row;
+} BmpReader;
+
+// Move to file offset `offset`; streams that cannot seek (pipes) can only
+// skip forward, by reading and discarding
+int bmp_seek(BmpReader *br, long offset) {
+    if (br->pos == offset) return 0;
+    if (fseek(br->fp, offset, SEEK_SET) == 0) {
+        br->pos = offset;
+        return 0;
+    }
+    if (br->pos < 0 || offset < br->pos) return 1;
+    for (; br->pos < offset; br->pos++) {
+        if (fgetc(br->fp) == EOF) return 1;
+    }
+    return 0;
+}
+
+// Start reading a BMP from an open stream (8-bit palettized/grayscale,
+// 24-bit BGR or 32-bit BGRA); the caller keeps ownership of `fp`
+// Only forward reads are needed when rows are requested in file order
+int bmp_open_fp(BmpReader *br, FILE *fp) {
+    memset(br, 0, sizeof(*br));
+    br->fp = fp;
+    
+    BITMAPFILEHEADER fh;
+    BITMAPINFOHEADER ih;
+    
+    if (fread(&fh, sizeof(BITMAPFILEHEADER), 1, br->fp) != 1 ||
+        fread(&ih, sizeof(BITMAPINFOHEADER), 1, br->fp) != 1) {
+        fprintf(stderr, "Error reading BMP header\n");
+        return 1;
+    }
+    br->pos = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+    
+    br->bpp = ih.biBitCount;
+    // BI_RGB, or BI_BITFIELDS for 32-bit files
+    if ((br->bpp != 8 && br->bpp != 24 && br->bpp != 32) ||
+        !(ih.biCompression == 0 || (ih.biCompression == 3 && br->bpp == 32))) {
+        fprintf(stderr, "Unsupported BMP format: %d-bit, compression %u\n", br->bpp, ih.biCompression);
+        return 1;
+    }
+    
+    // The R, G, B masks follow the 40-byte header (or are its next fields in
+    // larger headers); only the usual BGRA layout is supported
+    if (ih.biCompression == 3) {
+        uint32_t mask[3];
+        if (fread(mask, sizeof(uint32_t), 3, br->fp) != 3) {
+            fprintf(stderr, "Error reading BMP color masks\n");
+            return 1;
+        }
+        br->pos += sizeof(mask);
+        if (mask[0] != 0x00FF0000 || mask[1] != 0x0000FF00 || mask[2] != 0x000000FF) {
+            fprintf(stderr, "Unsupported BMP color masks: %08X %08X %08X\n", mask[0], mask[1], mask[2]);
+            return 1;
+        }
+    }
+    
+    if (ih.biWidth <= 0 || ih.biHeight == 0) {
+        fprintf(stderr, "Invalid BMP dimensions: %d x %d\n", ih.biWidth, ih.biHeight);
+        return 1;
+    }
+    
+    br->width = ih.biWidth;
+    br->height = abs(ih.biHeight);
+    br->bottom_up = ih.biHeight > 0;
+    br->stride = ((br->width * br->bpp + 31) / 32) * 4;
+    br->data_offset = fh.bfOffBits;
+    
+    // Palette follows the info header (which may be larger than 40 bytes)
+    if (br->bpp == 8) {
+        int ncolors = (ih.biClrUsed > 0 && ih.biClrUsed < 256) ? (int)ih.biClrUsed : 256;
+        if (bmp_seek(br, sizeof(BITMAPFILEHEADER) + ih.biSize)) {
+            fprintf(stderr, "Error reading BMP palette\n");
+            return 1;
+        }
+        br->gray_palette = 1;
+        for (int i = 0; i < ncolors; i++) {
+            unsigned char q[4];
+            if (fread(q, 1, 4, br->fp) != 4) {
+                fprintf(stderr, "Error reading BMP palette\n");
+                return 1;
+            }
+            br->palette[i].B = q[0];
+            br->palette[i].G = q[1];
+            br->palette[i].R = q[2];
+            if (q[0] != q[1] || q[1] != q[2]) br->gray_palette = 0;
+        }
+        br->pos += ncolors * 4;
+    }
+    
+    br->row = (unsigned char *)malloc(br->stride);
+    return 0;
+}
+
+// Read image rows [first, first + count) into rows[0..count-1], top-down
+int bmp_read_rows(BmpReader *br, int first, int count, Pixel **rows) {
+    // Stored rows of the range are contiguous in the file, in reverse order if bottom-up
+    int file_row = br->bottom_up ? (br->height - first - count) : first;
+    long offset = br->data_offset + (long)file_row * br->stride;
+    if (bmp_seek(br, offset)) {
+        fprintf(stderr, "Error seeking BMP pixel data\n");
+        br->pos = -1;
+        return 1;
+    }
+    
+    int needed = (br->width * br->bpp + 7) / 8;
+    for (int k = 0; k < count; k++) {
+        Pixel *dst = rows[br->bottom_up ? (count - 1 - k) : k];
+        
+        // The last stored row may come without its padding
+        size_t got = fread(br->row, 1, br->stride, br->fp);
+        if (got < (size_t)needed) {
+            fprintf(stderr, "Error reading BMP pixel data\n");
+            br->pos = -1;
+            return 1;
+        }
+        
+        if (br->bpp == 24) {
+            memcpy(dst, br->row, br->width * sizeof(Pixel));
+        } else if (br->bpp == 32) {
+            for (int j = 0; j < br->width; j++) {
+                dst[j].B = br->row[4 * j];
+                dst[j].G = br->row[4 * j + 1];
+                dst[j].R = br->row[4 * j + 2];
+            }
+        } else {
+            for (int j = 0; j < br->width; j++) {
+                dst[j] = br->palette[br->row[j]];
+            }
+        }
+    }
+    br->pos = offset + (long)count * br->stride;
+    return 0;
+}
+
+// Open a BMP file (8-bit palettized/grayscale, 24-bit BGR or 32-bit BGRA)
+int bmp_open(BmpReader *br, const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error opening file: %s\n", filename);
+        return 1;
+    }
+    if (bmp_open_fp(br, fp)) {
+        fclose(fp);
+        return 1;
+    }
+    return 0;
+}
+
+// Scan every row: returns 1 if all pixels have R == G == B (needs a seekable file)
+// A gray palette settles it at once; otherwise only the entries in use count
+int bmp_scan_gray(BmpReader *br) {
+    if (br->bpp == 8 && br->gray_palette) return 1;
+    
+    Pixel *row = (Pixel *)malloc(br->width * sizeof(Pixel));
+    int gray = 1;
+    for (int i = 0; i < br->height && gray; i++) {
+        // Visit rows in file order so the reads stay sequential
+        int y = br->bottom_up ? br->height - 1 - i : i;
+        if (bmp_read_rows(br, y, 1, &row)) {
+            gray = 0;
+            break;
+        }
+        gray = is_grayscale(&row, br->width, 1);
+    }
+    free(row);
+    return gray;
+}
+
+// Free the reader's buffers without closing the stream (see bmp_open_fp)
+void bmp_release(BmpReader *br) {
+    free(br->row);
+    br->row = NULL;
+}
+
+void bmp_close(BmpReader *br) {
+    bmp_release(br);
+    fclose(br->fp);
+}
+
+// Read BMP file (8-bit palettized/grayscale, 24-bit BGR or 32-bit BGRA)
+// Rows are returned top-down regardless of the orientation stored in the file
+Pixel** read_bmp(const char *filename, int *width, int *height) {
+    BmpReader br;
+    if (bmp_open(&br, filename)) return NULL;
+    
+    *width = br.width;
+    *height = br.height;
+    
+    Pixel **pixels = (Pixel **)malloc(*height * sizeof(Pixel *));
+    for (int i = 0; i < *height; i++) {
+        pixels[i] = (Pixel *)malloc(*width * sizeof(Pixel));
+    }
+    
+    if (bmp_read_rows(&br, 0, *height, pixels)) {
+        for (int i = 0; i < *height; i++) free(pixels[i]);
+        free(pixels);
+        bmp_close(&br);
+        return NULL;
+    }
+    
+    bmp_close(&br);
+    return pixels;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,236 @@
+#ifndef COEF_H
+#define COEF_H
+
+#include "bmp.h"
+
+#define COEF_ALIGN 32
+
+// Coefficient plane shared by all pipeline stages
+// One 8x8 block per 64 int16 entries, blocks in raster order,
+// channels stored back to back in a single 32-byte aligned allocation
+//
+// The channels are planar rather than interleaved per block (Y Cb Cr Y Cb Cr):
+// every output format keeps one file or stream per channel, so a planar
+// channel is written or entropy coded as one contiguous run
+// (write_coef_channel) without gathering strided blocks
+typedef struct {
+    int16_t *data;
+    int blocks_x;
+    int blocks_y;
+    int blocks;     // blocks per channel
+    int channels;
+} CoefPlane;
+
+int coef_plane_init(CoefPlane *plane, int width, int height, int channels) {
+    plane->blocks_x = (width + 7) / 8;
+    plane->blocks_y = (height + 7) / 8;
+    plane->blocks = plane->blocks_x * plane->blocks_y;
+    plane->channels = channels;
+
+    // Every block is 128 bytes, so the size is always a multiple of the alignment
+    size_t bytes = (size_t)channels * plane->blocks * 64 * sizeof(int16_t);
+    plane->data = (int16_t *)aligned_alloc(COEF_ALIGN, bytes);
+    if (!plane->data) {
+        fprintf(stderr, "Error allocating coefficient plane\n");
+        return 1;
+    }
+    memset(plane->data, 0, bytes);
+    return 0;
+}
+
+// View an existing aligned buffer (e.g. one pipeline strip) as a coefficient plane
+void coef_plane_wrap(CoefPlane *plane, void *data, int blocks_x, int blocks_y, int channels) {
+    plane->data = (int16_t *)data;
+    plane->blocks_x = blocks_x;
+    plane->blocks_y = blocks_y;
+    plane->blocks = blocks_x * blocks_y;
+    plane->channels = channels;
+}
+
+void coef_plane_free(CoefPlane *plane) {
+    free(plane->data);
+    plane->data = NULL;
+}
+
+// Pointer to the 64 coefficients of block `index` in channel `ch`
+int16_t *coef_block(const CoefPlane *plane, int ch, int index) {
+    return plane->data + ((size_t)ch * plane->blocks + index) * 64;
+}
+
+// Natural (row-major) order -> zig-zag order, in place, for blocks [first, last)
+void zigzag_blocks(CoefPlane *plane, int first, int last) {
+    for (int ch = 0; ch < plane->channels; ch++) {
+        for (int b = first; b < last; b++) {
+            int16_t *blk = coef_block(plane, ch, b);
+            int16_t tmp[64];
+            for (int i = 0; i < 64; i++) tmp[i] = blk[zigzag_order[i]];
+            memcpy(blk, tmp, sizeof(tmp));
+        }
+    }
+}
+
+// Zig-zag order -> natural order, in place, for blocks [first, last)
+void unzigzag_blocks(CoefPlane *plane, int first, int last) {
+    for (int ch = 0; ch < plane->channels; ch++) {
+        for (int b = first; b < last; b++) {
+            int16_t *blk = coef_block(plane, ch, b);
+            int16_t tmp[64];
+            for (int i = 0; i < 64; i++) tmp[zigzag_order[i]] = blk[i];
+            memcpy(blk, tmp, sizeof(tmp));
+        }
+    }
+}
+
+// dim file: "<width> <height>", plus a third field 1 for Y-only images
+int read_dim(const char *path, int *width, int *height, int *nc) {
+    FILE *fdim = fopen(path, "r");
+    if (!fdim || fscanf(fdim, "%d %d", width, height) != 2) {
+        fprintf(stderr, "Error reading dimensions: %s\n", path);
+        if (fdim) fclose(fdim);
+        return 1;
+    }
+    if (fscanf(fdim, "%d", nc) != 1 || *nc != 1) *nc = 3;
+    fclose(fdim);
+    return 0;
+}
+
+int write_dim(const char *path, int width, int height, int nc) {
+    FILE *fdim = fopen(path, "w");
+    if (!fdim) {
+        fprintf(stderr, "Error opening dimension file\n");
+        return 1;
+    }
+    if (nc == 1) fprintf(fdim, "%d %d 1\n", width, height);
+    else fprintf(fdim, "%d %d\n", width, height);
+    fclose(fdim);
+    return 0;
+}
+
+// Bulk write of one channel as raw int16 blocks
+int write_coef_channel(const CoefPlane *plane, int ch, FILE *fp) {
+    size_t n = (size_t)plane->blocks * 64;
+    if (fwrite(coef_block(plane, ch, 0), sizeof(int16_t), n, fp) != n) {
+        fprintf(stderr, "Error writing coefficient data\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Bulk read of one channel as raw int16 blocks
+int read_coef_channel(CoefPlane *plane, int ch, FILE *fp) {
+    size_t n = (size_t)plane->blocks * 64;
+    if (fread(coef_block(plane, ch, 0), sizeof(int16_t), n, fp) != n) {
+        fprintf(stderr, "Error reading quantized coefficients\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Rebuild one zig-zag ordered channel from the method 3 text streams
+// (DC DPCM differences, AC "(run,value)" pairs ending with EOB (0,0))
+int read_dpcm_rle_channel(CoefPlane *plane, int ch, FILE *fdc, FILE *fac) {
+    short last_dc = 0;
+    
+    for (int b = 0; b < plane->blocks; b++) {
+        int16_t *zz = coef_block(plane, ch, b);
+        memset(zz, 0, 64 * sizeof(int16_t));
+        
+        // DC DPCM
+        int diff;
+        if (fscanf(fdc, "%d", &diff) != 1 || diff < INT16_MIN || diff > INT16_MAX) {
+            fprintf(stderr, "Error reading DC coefficients\n");
+            return 1;
+        }
+        last_dc = (short)(last_dc + diff);
+        zz[0] = last_dc;
+        
+        // AC RLE, (15,0) stands for 16 zeros
+        int pos = 1;
+        for (;;) {
+            int run, value;
+            if (fscanf(fac, " (%d,%d)", &run, &value) != 2) {
+                fprintf(stderr, "Error reading AC coefficients\n");
+                return 1;
+            }
+            if (run < 0 || run > 15 || value < INT16_MIN || value > INT16_MAX ||
+                (value == 0 && run != 0 && run != 15)) {
+                fprintf(stderr, "Corrupt AC run / value pair (%d,%d)\n", run, value);
+                return 1;
+            }
+            if (value == 0) {
+                if (run == 0) break;
+                pos += 16;
+                continue;
+            }
+            pos += run;
+            if (pos > 63) {
+                fprintf(stderr, "Corrupt AC run length\n");
+                return 1;
+            }
+            zz[pos++] = value;
+        }
+    }
+    return 0;
+}
+
+// Framed coefficient stream: one header, then one frame per block row
+//
+//   header: magic "MMSP", uint16 version, uint16 channels, int32 width,
+//           int32 height, uint16 qtable[3][64] (natural order)
+//   strip:  int32 block row index, then for each channel blocks_x * 64
+//           int16 coefficients in zig-zag order
+#define STREAM_MAGIC 0x50534D4D     // "MMSP"
+#define STREAM_VERSION 1
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    int32_t width;
+    int32_t height;
+    uint16_t qtable[3][64];
+} StreamHeader;
+#pragma pack(pop)
+
+size_t stream_size(int width, int height, int channels) {
+    size_t blocks_x = ((size_t)width + 7) / 8;
+    size_t blocks_y = ((size_t)height + 7) / 8;
+    return sizeof(StreamHeader) + blocks_y * (sizeof(int32_t) + channels * blocks_x * 64 * sizeof(int16_t));
+}
+
+int stream_read_header(FILE *fp, StreamHeader *h) {
+    if (fread(h, sizeof(*h), 1, fp) != 1 || h->magic != STREAM_MAGIC ||
+        h->version != STREAM_VERSION || (h->channels != 1 && h->channels != 3) ||
+        h->width <= 0 || h->height <= 0) {
+        fprintf(stderr, "Error reading coefficient stream header\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Writes one block row held in a single-row plane
+int stream_write_strip(FILE *fp, int index, const CoefPlane *strip) {
+    int32_t idx = index;
+    size_t n = (size_t)strip->channels * strip->blocks * 64;
+    if (fwrite(&idx, sizeof(idx), 1, fp) != 1 ||
+        fwrite(strip->data, sizeof(int16_t), n, fp) != n) {
+        fprintf(stderr, "Error writing coefficient stream\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the next block row into a single-row plane; returns its index, -1 on error
+int stream_read_strip(FILE *fp, CoefPlane *strip, int blocks_y) {
+    int32_t idx;
+    size_t n = (size_t)strip->channels * strip->blocks * 64;
+    if (fread(&idx, sizeof(idx), 1, fp) != 1 || idx < 0 || idx >= blocks_y ||
+        fread(strip->data, sizeof(int16_t), n, fp) != n) {
+        fprintf(stderr, "Error reading coefficient stream\n");
+        return -1;
+    }
+    return idx;
+}
+
+#endif
@@ -1,4 +1,14 @@
-#include "bmp.h"
+#include "pipeline.h"
+#include "server.h"
+#include "rans.h"
+
+// --pipeline: strip-pipelined decode with background reader / writer threads
+static int opt_pipeline = 0;
+// --serve <socket> [--threads <n>]: long-running codec server
+static const char *opt_serve = NULL;
+static int opt_threads = 0;
+// --pipe: coefficient stream on stdin, BMP on stdout
+static int opt_pipe = 0;
 
 // Inverse DCT
 void perform_idct(double input[8][8], double output[8][8]) {
@@ -20,16 +30,11 @@ void perform_idct(double input[8][8], double output[8][8]) {
     }
 }
 
-// Write BMP file
-int write_bmp(const char *filename, Pixel **pixels, int width, int height) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        fprintf(stderr, "Error opening output BMP file: %s\n", filename);
-        return 1;
-    }
-    
+// Write 24-bit BMP headers; pixel rows follow at offset 54
+// A negative height marks a top-down file
+int write_bmp_header(FILE *fp, int width, int height) {
     int padding = (4 - (width * 3) % 4) % 4;
-    int dataSize = (width * 3 + padding) * height;
+    int dataSize = (width * 3 + padding) * abs(height);
     
     BITMAPFILEHEADER fh = {
         .bfType = 0x4D42,
@@ -56,6 +61,22 @@ int write_bmp(const char *filename, Pixel **pixels, int width, int height) {
     if (fwrite(&fh, sizeof(BITMAPFILEHEADER), 1, fp) != 1 ||
         fwrite(&ih, sizeof(BITMAPINFOHEADER), 1, fp) != 1) {
         fprintf(stderr, "Error writing BMP header\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Write BMP file
+int write_bmp(const char *filename, Pixel **pixels, int width, int height) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error opening output BMP file: %s\n", filename);
+        return 1;
+    }
+    
+    int padding = (4 - (width * 3) % 4) % 4;
+    
+    if (write_bmp_header(fp, width, height)) {
         fclose(fp);
         return 1;
     }
@@ -75,7 +96,9 @@ int write_bmp(const char *filename, Pixel **pixels, int width, int height) {
 
 // YCbCr to RGB conversion
 void ycbcr_to_rgb(double y, double cb, double cr, unsigned char *r, unsigned char *g, unsigned char *b) {
-    // Standard BT.601 conversion
+    // Standard BT.601 conversion (Cb / Cr carry the +128 offset from the encoder)
+    cb -= 128.0;
+    cr -= 128.0;
     double R = y + 1.402 * cr;
     double G = y - 0.344136 * cb - 0.714136 * cr;
     double B = y + 1.772 * cb;
@@ -85,54 +108,58 @@ void ycbcr_to_rgb(double y, double cb, double cr, unsigned char *r, unsigned cha
     *b = clamp(B);
 }
 
+// Sum of squared RGB errors over one row
+double row_sse(const Pixel *orig, const Pixel *rec, int width) {
+    double sse = 0.0;
+    for (int j = 0; j < width; j++) {
+        double err_r = orig[j].R - rec[j].R;
+        double err_g = orig[j].G - rec[j].G;
+        double err_b = orig[j].B - rec[j].B;
+        sse += err_r*err_r + err_g*err_g + err_b*err_b;
+    }
+    return sse;
+}
+
+double psnr_from_sse(double sse, long long count) {
+    double mse = sse / (3.0 * count);
+    if (mse < 0.0001) return 999.0;
+    return 10.0 * log10((255.0 * 255.0) / mse);
+}
+
 // Calculate PSNR
 double calculate_psnr(const char *orig_file, Pixel **pixels, int width, int height) {
-    FILE *fp = fopen(orig_file, "rb");
-    if (!fp) {
+    int orig_width, orig_height;
+    Pixel **orig = read_bmp(orig_file, &orig_width, &orig_height);
+    if (!orig) {
         fprintf(stderr, "Error opening original BMP file for PSNR calculation\n");
         return 0.0;
     }
-    
-    BITMAPFILEHEADER fh;
-    BITMAPINFOHEADER ih;
-    
-    if (fread(&fh, sizeof(fh), 1, fp) != 1 ||
-        fread(&ih, sizeof(ih), 1, fp) != 1) {
-        fprintf(stderr, "Error reading original BMP header\n");
-        fclose(fp);
+    if (orig_width != width || orig_height != height) {
+        fprintf(stderr, "Original BMP dimensions do not match\n");
+        for (int i = 0; i < orig_height; i++) free(orig[i]);
+        free(orig);
         return 0.0;
     }
     
-    int padding = (4 - (width * 3) % 4) % 4;
-    double mse = 0.0;
-    long long count = 0;
-    
+    double sse = 0.0;
     for (int i = 0; i < height; i++) {
-        int row_idx = (ih.biHeight > 0) ? (height - 1 - i) : i;
-        Pixel *row = (Pixel *)malloc(width * sizeof(Pixel));
-        
-        if (fread(row, sizeof(Pixel), width, fp) != (size_t)width) {
-            fprintf(stderr, "Error reading original BMP pixel data\n");
-            free(row);
-            fclose(fp);
-            return 0.0;
-        }
-        fseek(fp, padding, SEEK_CUR);
-        
-        for (int j = 0; j < width; j++) {
-            double err_r = row[j].R - pixels[row_idx][j].R;
-            double err_g = row[j].G - pixels[row_idx][j].G;
-            double err_b = row[j].B - pixels[row_idx][j].B;
-            mse += err_r*err_r + err_g*err_g + err_b*err_b;
-            count++;
-        }
-        free(row);
+        sse += row_sse(orig[i], pixels[i], width);
+        free(orig[i]);
     }
-    fclose(fp);
+    free(orig);
     
-    mse /= (3.0 * count);
-    if (mse < 0.0001) return 999.0;
-    return 10.0 * log10((255.0 * 255.0) / mse);
+    return psnr_from_sse(sse, (long long)width * height);
+}
+
+// Print PSNR and save it to psnr.txt
+void report_psnr(double psnr) {
+    printf("PSNR: %.2f dB\n", psnr);
+    
+    FILE *fpsnr = fopen("psnr.txt", "w");
+    if (fpsnr) {
+        fprintf(fpsnr, "%.2f\n", psnr);
+        fclose(fpsnr);
+    }
 }
 
 // Method 0: RGB channel reconstruction
@@ -197,18 +224,321 @@ int method_0_decoder(int argc, char *argv[]) {
     return 0;
 }
 
-// Method 2: IDCT + Dequantization + PSNR
-int method_2_decoder(int argc, char *argv[]) {
-    if (argc < 11) {
-        fprintf(stderr, "Usage: decoder 2 <orig.bmp> <out.bmp> <Qt_Y> <Qt_Cb> <Qt_Cr> <dim> <qF_Y.raw> <qF_Cb.raw> <qF_Cr.raw>\n");
+// Dequantization + IDCT + color conversion stage for blocks [first, last)
+// Coefficients are expected in natural order (after unzigzag_blocks)
+void reconstruct_blocks(const CoefPlane *plane, int Q[3][8][8], Pixel **pixels, int width, int height, int first, int last) {
+    int nc = plane->channels;
+    for (int b = first; b < last; b++) {
+        int bx = (b % plane->blocks_x) * 8;
+        int by = (b / plane->blocks_x) * 8;
+        
+        double ycbcr[3][8][8];
+        for (int ch = 0; ch < nc; ch++) {
+            const int16_t *q = coef_block(plane, ch, b);
+            
+            // Dequantization
+            double dct[8][8];
+            for (int u = 0; u < 8; u++) {
+                for (int v = 0; v < 8; v++) {
+                    dct[u][v] = q[u * 8 + v] * Q[ch][u][v];
+                }
+            }
+            
+            perform_idct(dct, ycbcr[ch]);
+        }
+        
+        // FIX #3: Proper level shift reversal
+        // Encoder did: value - 128.0 before DCT
+        // Decoder must do: value + 128.0 after IDCT
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 8; j++) {
+                int py = by + i;
+                int px = bx + j;
+                
+                if (py >= height || px >= width) continue;
+                
+                // Reverse level shift
+                double y = ycbcr[0][i][j] + 128.0;
+                
+                if (nc == 1) {
+                    unsigned char v = clamp(y);
+                    pixels[py][px].R = v;
+                    pixels[py][px].G = v;
+                    pixels[py][px].B = v;
+                    continue;
+                }
+                
+                double cb = ycbcr[1][i][j] + 128.0;
+                double cr = ycbcr[2][i][j] + 128.0;
+                
+                // YCbCr to RGB conversion
+                ycbcr_to_rgb(y, cb, cr, 
+                             &pixels[py][px].R,
+                             &pixels[py][px].G,
+                             &pixels[py][px].B);
+            }
+        }
+    }
+}
+
+// Reader thread callback: one block row of coefficients for every channel,
+// followed by the matching rows of the original image for PSNR
+typedef struct {
+    FILE **fqf;
+    int nc;
+    int blocks_x;
+    BmpReader *orig;    // NULL when the original is not available
+} DecoderStripSource;
+
+int fill_coef_strip(void *ctx, int index, void *buf) {
+    DecoderStripSource *src = (DecoderStripSource *)ctx;
+    size_t n = (size_t)src->blocks_x * 64;
+    int16_t *coef = (int16_t *)buf;
+    
+    for (int ch = 0; ch < src->nc; ch++) {
+        if (fread(coef + ch * n, sizeof(int16_t), n, src->fqf[ch]) != n) {
+            fprintf(stderr, "Error reading quantized coefficients\n");
+            return 1;
+        }
+    }
+    
+    if (src->orig) {
+        BmpReader *br = src->orig;
+        Pixel *strip = (Pixel *)(coef + src->nc * n);
+        int first = index * 8;
+        int count = (br->height - first < 8) ? br->height - first : 8;
+        Pixel *rows[8];
+        for (int i = 0; i < count; i++) rows[i] = strip + (size_t)i * br->width;
+        return bmp_read_rows(br, first, count, rows);
+    }
+    return 0;
+}
+
+// Method 2, pipelined: the reader thread prefetches coefficient strips (and
+// the original rows for PSNR) while the writer thread stores finished BMP
+// rows at their final file offset, so I/O overlaps with the IDCT.
+int method_2_decoder_pipelined(const char *orig_file, const char *out_file, int Q[3][8][8],
+                               FILE *fqf[3], int width, int height, int nc) {
+    BmpReader orig;
+    int have_orig = (bmp_open(&orig, orig_file) == 0);
+    if (have_orig && (orig.width != width || orig.height != height)) {
+        fprintf(stderr, "Original BMP dimensions do not match\n");
+        bmp_close(&orig);
+        have_orig = 0;
+    }
+    
+    FILE *fout = fopen(out_file, "wb");
+    if (!fout) {
+        fprintf(stderr, "Error opening output BMP file: %s\n", out_file);
+        return 1;
+    }
+    char *iobuf = pipeline_iobuf(fout);
+    if (write_bmp_header(fout, width, height)) return 1;
+    
+    int blocks_x = (width + 7) / 8;
+    int blocks_y = (height + 7) / 8;
+    size_t coef_bytes = (size_t)nc * blocks_x * 64 * sizeof(int16_t);
+    size_t stride = ((size_t)width * 3 + 3) / 4 * 4;
+    
+    DecoderStripSource src = { fqf, nc, blocks_x, have_orig ? &orig : NULL };
+    StripReader reader;
+    StripWriter writer;
+    if (strip_reader_start(&reader, coef_bytes + (size_t)8 * width * sizeof(Pixel), blocks_y, fill_coef_strip, &src) ||
+        strip_writer_start(&writer, 8 * stride)) {
         return 1;
     }
     
-    // Read quantization tables
-    int Q_Y[8][8], Q_Cb[8][8], Q_Cr[8][8];
-    FILE *fqy = fopen(argv[3], "r");
-    FILE *fqcb = fopen(argv[4], "r");
-    FILE *fqcr = fopen(argv[5], "r");
+    int err = 0;
+    double sse = 0.0;
+    for (int s = 0; s < blocks_y; s++) {
+        void *buf = strip_reader_next(&reader, s);
+        if (!buf) {
+            err = 1;
+            break;
+        }
+        
+        CoefPlane plane;
+        coef_plane_wrap(&plane, buf, blocks_x, 1, nc);
+        unzigzag_blocks(&plane, 0, blocks_x);
+        
+        // Rows are laid out bottom-up with padding, exactly as stored in the file
+        int first = s * 8;
+        int count = (height - first < 8) ? height - first : 8;
+        WriteJob *job = strip_writer_acquire(&writer);
+        Pixel *rows[8];
+        for (int i = 0; i < count; i++) {
+            rows[i] = (Pixel *)((char *)job->buf + (count - 1 - i) * stride);
+        }
+        reconstruct_blocks(&plane, Q, rows, width, count, 0, blocks_x);
+        
+        if (have_orig) {
+            Pixel *orig_rows = (Pixel *)((char *)buf + coef_bytes);
+            for (int i = 0; i < count; i++) {
+                sse += row_sse(orig_rows + (size_t)i * width, rows[i], width);
+            }
+        }
+        strip_reader_release(&reader);
+        
+        long offset = 54 + (long)(height - first - count) * stride;
+        write_job_add(job, fout, offset, 0, count * stride);
+        strip_writer_submit(&writer);
+    }
+    
+    if (strip_reader_finish(&reader)) err = 1;
+    if (strip_writer_finish(&writer)) {
+        fprintf(stderr, "Error writing pixel data\n");
+        err = 1;
+    }
+    fclose(fout);
+    free(iobuf);
+    if (have_orig) bmp_close(&orig);
+    if (err) return 1;
+    
+    if (have_orig) {
+        report_psnr(psnr_from_sse(sse, (long long)width * height));
+    } else {
+        fprintf(stderr, "Error opening original BMP file for PSNR calculation\n");
+        report_psnr(0.0);
+    }
+    
+    printf("Method 2 Decoder Complete (pipelined%s)\n", nc == 1 ? ", grayscale, Y only" : "");
+    return 0;
+}
+
+// Scratch memory needed by decode_stream
+size_t decode_scratch_size(const StreamHeader *h) {
+    size_t blocks_x = (h->width + 7) / 8;
+    size_t stride = ((size_t)h->width * 3 + 3) / 4 * 4;
+    return h->channels * blocks_x * 64 * sizeof(int16_t) + 8 * stride;
+}
+
+// Decode a framed coefficient stream (coef.h) into a 24-bit BMP, one block row
+// at a time; rows are stored at their final offset
+// The first strip picks the row order: a stream that starts with the top block
+// row gives a top-down BMP, otherwise bottom-up. A stream in file order
+// (encode_stream) is then written strictly forward, so `out` may be a pipe
+// Every block row must appear exactly once, so all pixel rows get written
+// `scratch` must be COEF_ALIGN aligned and hold decode_scratch_size() bytes
+int decode_stream(const StreamHeader *h, FILE *in, FILE *out, void *scratch) {
+    int width = h->width, height = h->height, nc = h->channels;
+    int blocks_x = (width + 7) / 8;
+    int blocks_y = (height + 7) / 8;
+    size_t stride = ((size_t)width * 3 + 3) / 4 * 4;
+    
+    int Q[3][8][8];
+    for (int ch = 0; ch < 3; ch++) {
+        for (int i = 0; i < 64; i++) Q[ch][i / 8][i % 8] = h->qtable[ch][i];
+    }
+    
+    CoefPlane plane;
+    coef_plane_wrap(&plane, scratch, blocks_x, 1, nc);
+    char *strip = (char *)(plane.data + (size_t)nc * blocks_x * 64);
+    memset(strip, 0, 8 * stride);
+    
+    int index = stream_read_strip(in, &plane, blocks_y);
+    if (index < 0) return 1;
+    int top_down = (index == 0 && blocks_y > 1);
+    if (write_bmp_header(out, width, top_down ? -height : height)) return 1;
+    long pos = 54;
+    
+    // blocks_y strips without a repeat cover every block row
+    unsigned char *seen = (unsigned char *)calloc(blocks_y, 1);
+    if (!seen) return 1;
+    
+    for (int s = 0; s < blocks_y; s++) {
+        if (s > 0 && (index = stream_read_strip(in, &plane, blocks_y)) < 0) {
+            free(seen);
+            return 1;
+        }
+        if (seen[index]) {
+            fprintf(stderr, "Duplicate block row %d in coefficient stream\n", index);
+            free(seen);
+            return 1;
+        }
+        seen[index] = 1;
+        unzigzag_blocks(&plane, 0, blocks_x);
+        
+        // Rows are laid out with padding, exactly as stored in the file
+        int first = index * 8;
+        int count = (height - first < 8) ? height - first : 8;
+        Pixel *rows[8];
+        for (int i = 0; i < count; i++) rows[i] = (Pixel *)(strip + (top_down ? i : count - 1 - i) * stride);
+        reconstruct_blocks(&plane, Q, rows, width, count, 0, blocks_x);
+        
+        long offset = 54 + (long)(top_down ? first : height - first - count) * stride;
+        if ((offset != pos && fseek(out, offset, SEEK_SET) != 0) ||
+            fwrite(strip, 1, count * stride, out) != count * stride) {
+            fprintf(stderr, "Error writing pixel data\n");
+            free(seen);
+            return 1;
+        }
+        pos = offset + count * stride;
+    }
+    free(seen);
+    return 0;
+}
+
+// Size of the 24-bit BMP written by decode_stream
+size_t decoded_bmp_size(const StreamHeader *h) {
+    return 54 + ((size_t)h->width * 3 + 3) / 4 * 4 * h->height;
+}
+
+// Server: response size for a DECODE request (coefficient stream payload)
+// Rejects a header whose strips do not all fit in the payload
+size_t decode_response_size(uint32_t type, const char *payload, size_t len) {
+    if (type != REQ_DECODE || len < sizeof(StreamHeader)) return 0;
+    
+    StreamHeader h;
+    memcpy(&h, payload, sizeof(h));
+    if (h.magic != STREAM_MAGIC || (h.channels != 1 && h.channels != 3) ||
+        h.width <= 0 || h.height <= 0) {
+        return 0;
+    }
+    
+    uint64_t blocks_x = ((uint64_t)h.width + 7) / 8;
+    uint64_t blocks_y = ((uint64_t)h.height + 7) / 8;
+    uint64_t strip = sizeof(int32_t) + h.channels * blocks_x * 64 * sizeof(int16_t);
+    if (blocks_y > (len - sizeof(StreamHeader)) / strip) return 0;
+    return decoded_bmp_size(&h);
+}
+
+// Server: DECODE request handler
+int serve_decode(ServerWorker *w, uint32_t type, FILE *in, FILE *out, size_t *out_len) {
+    StreamHeader h;
+    if (stream_read_header(in, &h)) return 1;
+    
+    void *scratch = server_scratch(w, decode_scratch_size(&h));
+    if (!scratch || decode_stream(&h, in, out, scratch)) return 1;
+    *out_len = decoded_bmp_size(&h);
+    return 0;
+}
+
+// Pipe mode: strips are decoded as they arrive, memory stays at one strip
+int pipe_decode(void) {
+    // Buffers go in before the first read; static, since stdout is flushed at exit
+    static char inbuf[PIPELINE_IOBUF], outbuf[PIPELINE_IOBUF];
+    setvbuf(stdin, inbuf, _IOFBF, PIPELINE_IOBUF);
+    setvbuf(stdout, outbuf, _IOFBF, PIPELINE_IOBUF);
+    
+    StreamHeader h;
+    if (stream_read_header(stdin, &h)) return 1;
+    
+    size_t size = (decode_scratch_size(&h) + COEF_ALIGN - 1) / COEF_ALIGN * COEF_ALIGN;
+    void *scratch = aligned_alloc(COEF_ALIGN, size);
+    
+    int err = !scratch || decode_stream(&h, stdin, stdout, scratch) || fflush(stdout) != 0;
+    if (err) fprintf(stderr, "Pipe decode failed\n");
+    
+    free(scratch);
+    return err;
+}
+
+// Method 2: IDCT + Dequantization + PSNR
+// Read the three quantization tables (Y, Cb, Cr) from text files
+int read_qtables(char *paths[3], int Q[3][8][8]) {
+    FILE *fqy = fopen(paths[0], "r");
+    FILE *fqcb = fopen(paths[1], "r");
+    FILE *fqcr = fopen(paths[2], "r");
     
     if (!fqy || !fqcb || !fqcr) {
         fprintf(stderr, "Error opening quantization table files\n");
@@ -217,9 +547,9 @@ int method_2_decoder(int argc, char *argv[]) {
     
     for (int i = 0; i < 8; i++) {
         for (int j = 0; j < 8; j++) {
-            if (fscanf(fqy, "%d", &Q_Y[i][j]) != 1 ||
-                fscanf(fqcb, "%d", &Q_Cb[i][j]) != 1 ||
-                fscanf(fqcr, "%d", &Q_Cr[i][j]) != 1) {
+            if (fscanf(fqy, "%d", &Q[0][i][j]) != 1 ||
+                fscanf(fqcb, "%d", &Q[1][i][j]) != 1 ||
+                fscanf(fqcr, "%d", &Q[2][i][j]) != 1) {
                 fprintf(stderr, "Error reading quantization tables\n");
                 return 1;
             }
@@ -228,24 +558,44 @@ int method_2_decoder(int argc, char *argv[]) {
     fclose(fqy); 
     fclose(fqcb); 
     fclose(fqcr);
-    
-    // Read dimensions
-    int width, height;
-    FILE *fdim = fopen(argv[6], "r");
-    if (!fdim || fscanf(fdim, "%d %d", &width, &height) != 2) {
-        fprintf(stderr, "Error reading dimensions\n");
+    return 0;
+}
+
+int method_2_decoder(int argc, char *argv[]) {
+    if (argc < 11) {
+        fprintf(stderr, "Usage: decoder 2 <orig.bmp> <out.bmp> <Qt_Y> <Qt_Cb> <Qt_Cr> <dim> <qF_Y.raw> <qF_Cb.raw> <qF_Cr.raw>\n");
         return 1;
     }
-    fclose(fdim);
+    
+    // Read quantization tables
+    int Q[3][8][8];
+    if (read_qtables(argv + 4, Q)) return 1;
+    
+    // Read dimensions (optional third field: component count, 1 = Y only)
+    int width, height, nc;
+    if (read_dim(argv[7], &width, &height, &nc)) return 1;
     
     // Open quantized coefficient files
-    FILE *fqfy = fopen(argv[7], "rb");
-    FILE *fqfcb = fopen(argv[8], "rb");
-    FILE *fqfcr = fopen(argv[9], "rb");
+    FILE *fqf[3];
+    for (int ch = 0; ch < nc; ch++) {
+        fqf[ch] = fopen(argv[8 + ch], "rb");
+        if (!fqf[ch]) {
+            fprintf(stderr, "Error opening quantized coefficient files\n");
+            return 1;
+        }
+    }
     
-    if (!fqfy || !fqfcb || !fqfcr) {
-        fprintf(stderr, "Error opening quantized coefficient files\n");
-        return 1;
+    if (opt_pipeline) {
+        int err = method_2_decoder_pipelined(argv[2], argv[3], Q, fqf, width, height, nc);
+        for (int ch = 0; ch < nc; ch++) fclose(fqf[ch]);
+        return err;
+    }
+    
+    // Bulk read of every channel into the coefficient plane
+    CoefPlane plane;
+    if (coef_plane_init(&plane, width, height, nc)) return 1;
+    for (int ch = 0; ch < nc; ch++) {
+        if (read_coef_channel(&plane, ch, fqf[ch])) return 1;
     }
     
     Pixel **pixels = (Pixel **)malloc(height * sizeof(Pixel *));
@@ -253,107 +603,132 @@ int method_2_decoder(int argc, char *argv[]) {
         pixels[i] = (Pixel *)malloc(width * sizeof(Pixel));
     }
     
-    // Process each 8x8 block
-    for (int by = 0; by < height; by += 8) {
-        for (int bx = 0; bx < width; bx += 8) {
-            short zz_q_y[64], zz_q_cb[64], zz_q_cr[64];
-            
-            // Read quantized coefficients (in zig-zag order)
-            if (fread(zz_q_y, sizeof(short), 64, fqfy) != 64 ||
-                fread(zz_q_cb, sizeof(short), 64, fqfcb) != 64 ||
-                fread(zz_q_cr, sizeof(short), 64, fqfcr) != 64) {
-                fprintf(stderr, "Error reading quantized coefficients\n");
-                return 1;
-            }
-            
-            // Convert from zig-zag order back to 2D - FIX #1: Correct inverse zig-zag
-            double dct_y[8][8], dct_cb[8][8], dct_cr[8][8];
-            memset(dct_y, 0, sizeof(dct_y));
-            memset(dct_cb, 0, sizeof(dct_cb));
-            memset(dct_cr, 0, sizeof(dct_cr));
-            
-            // FIX #1: Reverse zig-zag lookup table
-            for (int i = 0; i < 64; i++) {
-                int zz_pos = zigzag_order[i];  // Get 2D position from zig-zag index
-                int u = zz_pos / 8;
-                int v = zz_pos % 8;
-                
-                // Dequantization
-                dct_y[u][v] = zz_q_y[i] * Q_Y[u][v];
-                dct_cb[u][v] = zz_q_cb[i] * Q_Cb[u][v];
-                dct_cr[u][v] = zz_q_cr[i] * Q_Cr[u][v];
-            }
-            
-            // IDCT
-            double ycbcr_y[8][8], ycbcr_cb[8][8], ycbcr_cr[8][8];
-            perform_idct(dct_y, ycbcr_y);
-            perform_idct(dct_cb, ycbcr_cb);
-            perform_idct(dct_cr, ycbcr_cr);
-            
-            // FIX #3: Proper level shift reversal
-            // Encoder did: value - 128.0 before DCT
-            // Decoder must do: value + 128.0 after IDCT
-            for (int i = 0; i < 8; i++) {
-                for (int j = 0; j < 8; j++) {
-                    int py = by + i;
-                    int px = bx + j;
-                    
-                    if (py >= height || px >= width) continue;
-                    
-                    // Reverse level shift
-                    double y = ycbcr_y[i][j] + 128.0;
-                    double cb = ycbcr_cb[i][j] + 128.0;
-                    double cr = ycbcr_cr[i][j] + 128.0;
-                    
-                    // YCbCr to RGB conversion
-                    ycbcr_to_rgb(y, cb, cr, 
-                                 &pixels[py][px].R,
-                                 &pixels[py][px].G,
-                                 &pixels[py][px].B);
-                }
-            }
-        }
-    }
+    // Inverse zig-zag and reconstruction stages - FIX #1: Correct inverse zig-zag
+    unzigzag_blocks(&plane, 0, plane.blocks);
+    reconstruct_blocks(&plane, Q, pixels, width, height, 0, plane.blocks);
+    coef_plane_free(&plane);
     
-    fclose(fqfy); 
-    fclose(fqfcb); 
-    fclose(fqfcr);
+    for (int ch = 0; ch < nc; ch++) fclose(fqf[ch]);
     
     // Write output BMP
-    if (write_bmp(argv[2], pixels, width, height)) {
+    if (write_bmp(argv[3], pixels, width, height)) {
         return 1;
     }
     
     // Calculate and save PSNR
-    double psnr = calculate_psnr(argv[1], pixels, width, height);
-    printf("PSNR: %.2f dB\n", psnr);
+    report_psnr(calculate_psnr(argv[2], pixels, width, height));
     
-    FILE *fpsnr = fopen("psnr.txt", "w");
-    if (fpsnr) {
-        fprintf(fpsnr, "%.2f\n", psnr);
-        fclose(fpsnr);
+    for (int i = 0; i < height; i++) free(pixels[i]);
+    free(pixels);
+    
+    printf("Method 2 Decoder Complete%s\n", nc == 1 ? " (grayscale, Y only)" : "");
+    return 0;
+}
+
+// Method 3: entropy decoding of the DPCM / RLE streams (text or rANS),
+// then the same reconstruction as method 2
+int method_3_decoder(int argc, char *argv[]) {
+    if (argc < 14) {
+        fprintf(stderr, "Usage: decoder 3 <orig.bmp> <out.bmp> <Qt_Y> <Qt_Cb> <Qt_Cr> <dim> <DC_Y> <DC_Cb> <DC_Cr> <AC_Y> <AC_Cb> <AC_Cr>\n");
+        return 1;
+    }
+    
+    int Q[3][8][8];
+    if (read_qtables(argv + 4, Q)) return 1;
+    
+    int width, height, nc;
+    if (read_dim(argv[7], &width, &height, &nc)) return 1;
+    
+    CoefPlane plane;
+    if (coef_plane_init(&plane, width, height, nc)) return 1;
+    
+    // The stream format is detected per channel, see read_entropy_channel
+    for (int ch = 0; ch < nc; ch++) {
+        FILE *fdc = fopen(argv[8 + ch], "rb");
+        FILE *fac = fopen(argv[11 + ch], "rb");
+        if (!fdc || !fac) {
+            fprintf(stderr, "Error opening entropy coded files\n");
+            return 1;
+        }
+        int err = read_entropy_channel(&plane, ch, fdc, fac);
+        fclose(fdc);
+        fclose(fac);
+        if (err) return 1;
     }
     
+    Pixel **pixels = (Pixel **)malloc(height * sizeof(Pixel *));
+    for (int i = 0; i < height; i++) {
+        pixels[i] = (Pixel *)malloc(width * sizeof(Pixel));
+    }
+    
+    unzigzag_blocks(&plane, 0, plane.blocks);
+    reconstruct_blocks(&plane, Q, pixels, width, height, 0, plane.blocks);
+    coef_plane_free(&plane);
+    
+    if (write_bmp(argv[3], pixels, width, height)) {
+        return 1;
+    }
+    
+    report_psnr(calculate_psnr(argv[2], pixels, width, height));
+    
     for (int i = 0; i < height; i++) free(pixels[i]);
     free(pixels);
     
-    printf("Method 2 Decoder Complete\n");
+    printf("Method 3 Decoder Complete%s\n", nc == 1 ? " (grayscale, Y only)" : "");
     return 0;
 }
 
 int main(int argc, char *argv[]) {
+    // Leading options, e.g. ./decoder --pipeline 2 ...
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        int used = 1;
+        if (strcmp(argv[1], "--pipeline") == 0) {
+            opt_pipeline = 1;
+        } else if (strcmp(argv[1], "--pipe") == 0) {
+            opt_pipe = 1;
+        } else if (strcmp(argv[1], "--serve") == 0 && argc > 2) {
+            opt_serve = argv[2];
+            used = 2;
+        } else if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+            opt_threads = atoi(argv[2]);
+            used = 2;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[1]);
+            return 1;
+        }
+        argv += used;
+        argc -= used;
+    }
+    
+    if (opt_serve) {
+        int threads = opt_threads > 0 ? opt_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return run_server(opt_serve, threads, serve_decode, decode_response_size);
+    }
+    
+    if (opt_pipe) return pipe_decode();
+    
     if (argc < 2) {
-        fprintf(stderr, "Usage: ./decoder <method> ...\n");
+        fprintf(stderr, "Usage: ./decoder [--pipeline] <0|2|3> ...\n");
+        fprintf(stderr, "       ./decoder --serve <socket> [--threads <n>]\n");
+        fprintf(stderr, "       ./decoder --pipe < in.stream > out.bmp\n");
+        fprintf(stderr, "Method 0 reads encoder 0 text, 2 the qF_* files of encoder 1,\n");
+        fprintf(stderr, "       3 the DC_* / AC_* files of encoder 3 (text or --rans)\n");
         return 1;
     }
     
     int method = atoi(argv[1]);
+    if (opt_pipeline && method != 2) {
+        fprintf(stderr, "--pipeline is only supported by method 2\n");
+        return 1;
+    }
     
     switch (method) {
         case 0:
             return method_0_decoder(argc, argv);
         case 2:
             return method_2_decoder(argc, argv);
+        case 3:
+            return method_3_decoder(argc, argv);
         default:
             fprintf(stderr, "Unknown method: %d\n", method);
             return 1;
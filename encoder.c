@@ -1,4 +1,24 @@
-#include "bmp.h"
+#include "pipeline.h"
+#include "server.h"
+#include "rans.h"
+
+// --pipeline: strip-pipelined encode with background reader / writer threads
+static int opt_pipeline = 0;
+// --serve <socket> [--threads <n>]: long-running codec server
+static const char *opt_serve = NULL;
+static int opt_threads = 0;
+// --prev <old.bmp> / --hash <blocks.hash>: incremental re-encode of changed blocks
+static const char *opt_prev = NULL;
+static const char *opt_hash = NULL;
+// --rows <first>:<last>: encode only block rows [first, last) as a standalone stripe
+static int opt_rows = 0;
+static int opt_row_first = 0;
+static int opt_row_last = 0;
+// --pipe: BMP on stdin, coefficient stream on stdout (./encoder --pipe | ./decoder --pipe)
+static int opt_pipe = 0;
+// --rans: method 3 symbols as rANS streams instead of text; --bench: compare both
+static int opt_rans = 0;
+static int opt_bench = 0;
 
 // Standard JPEG quantization matrices
 static const int std_qtable_Y[8][8] = {
@@ -44,44 +64,9 @@ void perform_dct(double input[8][8], double output[8][8]) {
     }
 }
 
-// Read BMP file
-Pixel** read_bmp(const char *filename, int *width, int *height) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error opening file: %s\n", filename);
-        return NULL;
-    }
-    
-    BITMAPFILEHEADER fh;
-    BITMAPINFOHEADER ih;
-    
-    if (fread(&fh, sizeof(BITMAPFILEHEADER), 1, fp) != 1 ||
-        fread(&ih, sizeof(BITMAPINFOHEADER), 1, fp) != 1) {
-        fprintf(stderr, "Error reading BMP header\n");
-        fclose(fp);
-        return NULL;
-    }
-    
-    *width = ih.biWidth;
-    *height = abs(ih.biHeight);
-    
-    int padding = (4 - (*width * 3) % 4) % 4;
-    Pixel **pixels = (Pixel **)malloc(*height * sizeof(Pixel *));
-    
-    for (int i = 0; i < *height; i++) {
-        pixels[i] = (Pixel *)malloc(*width * sizeof(Pixel));
-        int row_idx = (ih.biHeight > 0) ? (*height - 1 - i) : i;
-        
-        if (fread(pixels[row_idx], sizeof(Pixel), *width, fp) != (size_t)*width) {
-            fprintf(stderr, "Error reading BMP pixel data\n");
-            fclose(fp);
-            return NULL;
-        }
-        fseek(fp, padding, SEEK_CUR);
-    }
-    
-    fclose(fp);
-    return pixels;
+// Luma only (BT.601), shared by the color and single-component paths
+double rgb_to_y(Pixel pixel) {
+    return 0.299 * pixel.R + 0.587 * pixel.G + 0.114 * pixel.B;
 }
 
 // RGB to YCbCr conversion (BT.601) - FIX #2: Added +128 offset for Cb and Cr
@@ -91,7 +76,7 @@ void rgb_to_ycbcr(Pixel pixel, double *y, double *cb, double *cr) {
     double b = pixel.B;
     
     // YCbCr conversion with proper DC offset
-    *y = 0.299 * r + 0.587 * g + 0.114 * b;
+    *y = rgb_to_y(pixel);
     *cb = -0.168736 * r - 0.331264 * g + 0.5 * b + 128.0;     // FIX: +128
     *cr = 0.5 * r - 0.418688 * g - 0.081312 * b + 128.0;      // FIX: +128
 }
@@ -147,21 +132,366 @@ int method_0_encoder(int argc, char *argv[]) {
     return 0;
 }
 
-// Method 1: DCT + Quantization
-int method_1_encoder(int argc, char *argv[]) {
-    if (argc < 13) {
-        fprintf(stderr, "Usage: encoder 1 <bmp> <Qt_Y> <Qt_Cb> <Qt_Cr> <dim> <qF_Y.raw> <qF_Cb.raw> <qF_Cr.raw> <eF_Y.raw> <eF_Cb.raw> <eF_Cr.raw>\n");
-        return 1;
+// Copy one 8x8 block out of the image
+// Edge blocks replicate the last row / column
+void gather_block(Pixel **pixels, int width, int height, int bx, int by, Pixel px[64]) {
+    for (int i = 0; i < 8; i++) {
+        int py = by + i;
+        if (py >= height) py = height - 1;
+        for (int j = 0; j < 8; j++) {
+            int px_x = bx + j;
+            if (px_x >= width) px_x = width - 1;
+            px[i * 8 + j] = pixels[py][px_x];
+        }
+    }
+}
+
+// Convert one 8x8 block to level-shifted Y (and Cb, Cr when nc == 3)
+void load_block(const Pixel px[64], int nc, double block[3][8][8]) {
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            // Level shift all components to -128...127 range
+            if (nc == 1) {
+                block[0][i][j] = rgb_to_y(px[i * 8 + j]) - 128.0;
+            } else {
+                double y, cb, cr;
+                rgb_to_ycbcr(px[i * 8 + j], &y, &cb, &cr);
+                block[0][i][j] = y - 128.0;
+                block[1][i][j] = cb - 128.0;      // FIX: Now cb has +128 from rgb_to_ycbcr
+                block[2][i][j] = cr - 128.0;
+            }
+        }
+    }
+}
+
+uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t k = 0; k < len; k++) h = (h ^ p[k]) * 1099511628211ULL;
+    return h;
+}
+
+#define FNV_OFFSET 1469598103934665603ULL
+
+// Flat / duplicate block shortcuts for transform_blocks
+// Constant blocks only have a DC term; exact repeats of a recently seen
+// block (direct-mapped cache keyed on the pixel hash) reuse its coefficients.
+#define BLOCK_CACHE_SIZE 256
+
+typedef struct {
+    int valid;
+    uint64_t hash;
+    Pixel px[64];
+    int16_t coef[3][64];    // natural order
+} BlockCacheEntry;
+
+typedef struct {
+    long long blocks;
+    long long flat;
+    long long duplicate;
+    BlockCacheEntry entries[BLOCK_CACHE_SIZE];
+} BlockCache;
+
+BlockCache *block_cache_new(void) {
+    return (BlockCache *)calloc(1, sizeof(BlockCache));
+}
+
+void block_cache_report(const BlockCache *cache) {
+    if (!cache || cache->blocks == 0) return;
+    printf("Flat blocks: %lld (%.1f%%), duplicate blocks: %lld (%.1f%%) of %lld\n",
+           cache->flat, 100.0 * cache->flat / cache->blocks,
+           cache->duplicate, 100.0 * cache->duplicate / cache->blocks, cache->blocks);
+}
+
+int is_flat_block(const Pixel px[64]) {
+    for (int i = 1; i < 64; i++) {
+        if (px[i].R != px[0].R || px[i].G != px[0].G || px[i].B != px[0].B) return 0;
+    }
+    return 1;
+}
+
+// DC-only result of a constant block
+// The DC sum is accumulated exactly like perform_dct (cos(0) == 1), and every
+// AC term of a constant block rounds to zero, so the result is bit-identical
+void flat_block(Pixel p, int nc, CoefPlane *plane, int b) {
+    double v[3];
+    if (nc == 1) {
+        v[0] = rgb_to_y(p) - 128.0;
+    } else {
+        rgb_to_ycbcr(p, &v[0], &v[1], &v[2]);
+        v[0] -= 128.0;
+        v[1] -= 128.0;
+        v[2] -= 128.0;
     }
     
-    int width, height;
-    Pixel **pixels = read_bmp(argv[2], &width, &height);
-    if (!pixels) return 1;
+    double Cu = 1.0 / sqrt(2.0), Cv = 1.0 / sqrt(2.0);
+    for (int ch = 0; ch < nc; ch++) {
+        const int (*qtable)[8] = (ch == 0) ? std_qtable_Y : std_qtable_C;
+        int16_t *q = coef_block(plane, ch, b);
+        
+        double sum = 0.0;
+        for (int k = 0; k < 64; k++) sum += v[ch];
+        
+        memset(q, 0, 64 * sizeof(int16_t));
+        q[0] = (int16_t)round(0.25 * Cu * Cv * sum / qtable[0][0]);
+    }
+}
+
+// Color conversion + DCT + quantization stage for blocks [first, last)
+// Output is in natural (row-major) order; zig-zag is a separate stage
+// `cache` (may be NULL) enables the flat / duplicate block shortcuts
+void transform_blocks(Pixel **pixels, int width, int height, CoefPlane *plane, int first, int last, BlockCache *cache) {
+    int nc = plane->channels;
+    for (int b = first; b < last; b++) {
+        int bx = (b % plane->blocks_x) * 8;
+        int by = (b / plane->blocks_x) * 8;
+        
+        Pixel px[64];
+        gather_block(pixels, width, height, bx, by, px);
+        
+        BlockCacheEntry *entry = NULL;
+        uint64_t hash = 0;
+        if (cache) {
+            cache->blocks++;
+            if (is_flat_block(px)) {
+                flat_block(px[0], nc, plane, b);
+                cache->flat++;
+                continue;
+            }
+            
+            hash = fnv1a(FNV_OFFSET, px, sizeof(px));
+            entry = &cache->entries[hash % BLOCK_CACHE_SIZE];
+            if (entry->valid && entry->hash == hash && memcmp(entry->px, px, sizeof(px)) == 0) {
+                for (int ch = 0; ch < nc; ch++) {
+                    memcpy(coef_block(plane, ch, b), entry->coef[ch], 64 * sizeof(int16_t));
+                }
+                cache->duplicate++;
+                continue;
+            }
+        }
+        
+        double block[3][8][8];
+        load_block(px, nc, block);
+        
+        for (int ch = 0; ch < nc; ch++) {
+            const int (*qtable)[8] = (ch == 0) ? std_qtable_Y : std_qtable_C;
+            int16_t *q = coef_block(plane, ch, b);
+            
+            double dct[8][8];
+            perform_dct(block[ch], dct);
+            
+            for (int u = 0; u < 8; u++) {
+                for (int v = 0; v < 8; v++) {
+                    q[u * 8 + v] = (int16_t)round(dct[u][v] / qtable[u][v]);
+                }
+            }
+        }
+        
+        if (entry) {
+            entry->valid = 1;
+            entry->hash = hash;
+            memcpy(entry->px, px, sizeof(px));
+            for (int ch = 0; ch < nc; ch++) {
+                memcpy(entry->coef[ch], coef_block(plane, ch, b), 64 * sizeof(int16_t));
+            }
+        }
+    }
+}
+
+// Entropy stage: DC DPCM + AC RLE of one zig-zag ordered channel
+void entropy_code_channel(const CoefPlane *plane, int ch, FILE *fdc, FILE *fac) {
+    int last_dc = 0;
+    
+    for (int b = 0; b < plane->blocks; b++) {
+        const int16_t *zz_q = coef_block(plane, ch, b);
+        
+        // DC DPCM
+        short dc_diff = zz_q[0] - last_dc;
+        fprintf(fdc, "%d ", dc_diff);
+        last_dc = zz_q[0];
+        
+        // AC RLE (skip DC which is at position 0)
+        int run_length = 0;
+        for (int i = 1; i < 64; i++) {
+            if (zz_q[i] == 0) {
+                run_length++;
+            } else {
+                while (run_length > 15) {
+                    fprintf(fac, "(15,0) ");
+                    run_length -= 16;
+                }
+                fprintf(fac, "(%d,%d) ", run_length, zz_q[i]);
+                run_length = 0;
+            }
+        }
+        // EOB
+        fprintf(fac, "(0,0) ");
+        fprintf(fac, "\n");
+    }
+}
+
+// Method 3 symbols of one channel for the rANS backend (rans.h), in the same
+// order as entropy_code_channel writes its text tokens
+int collect_symbols(const CoefPlane *plane, int ch, SymbolBuffer *dc, SymbolBuffer *ac) {
+    symbols_init(dc);
+    symbols_init(ac);
+    int last_dc = 0;
     
-    // Output quantization tables
-    FILE *fqty = fopen(argv[3], "w");
-    FILE *fqtcb = fopen(argv[4], "w");
-    FILE *fqtcr = fopen(argv[5], "w");
+    for (int b = 0; b < plane->blocks; b++) {
+        const int16_t *zz_q = coef_block(plane, ch, b);
+        
+        // DC DPCM
+        short dc_diff = zz_q[0] - last_dc;
+        int size = value_size(dc_diff);
+        symbols_put(dc, size, value_bits(dc_diff, size), size);
+        last_dc = zz_q[0];
+        
+        // AC RLE, 0xF0 = 16 zeros
+        int run_length = 0;
+        for (int i = 1; i < 64; i++) {
+            if (zz_q[i] == 0) {
+                run_length++;
+                continue;
+            }
+            while (run_length > 15) {
+                symbols_put(ac, 0xF0, 0, 0);
+                run_length -= 16;
+            }
+            size = value_size(zz_q[i]);
+            if (size > 15) {
+                fprintf(stderr, "AC coefficient %d out of range for rANS coding\n", zz_q[i]);
+                return 1;
+            }
+            symbols_put(ac, (run_length << 4) | size, value_bits(zz_q[i], size), size);
+            run_length = 0;
+        }
+        // EOB
+        symbols_put(ac, 0x00, 0, 0);
+    }
+    return 0;
+}
+
+int rans_code_channel(const CoefPlane *plane, int ch, FILE *fdc, FILE *fac) {
+    SymbolBuffer dc, ac;
+    int err = collect_symbols(plane, ch, &dc, &ac) ||
+              !rans_write_stream(&dc, fdc) || !rans_write_stream(&ac, fac);
+    symbols_free(&dc);
+    symbols_free(&ac);
+    return err;
+}
+
+// Size in bits of an optimal Huffman code for the given symbol counts:
+// every merge of the two lightest nodes adds one bit to each symbol below it
+uint64_t huffman_bits(const uint32_t count[256]) {
+    uint64_t w[256];
+    int n = 0;
+    for (int s = 0; s < 256; s++) {
+        if (count[s]) w[n++] = count[s];
+    }
+    if (n == 1) return w[0];
+    
+    uint64_t total = 0;
+    while (n > 1) {
+        int a = (w[0] <= w[1]) ? 0 : 1, b = 1 - a;
+        for (int k = 2; k < n; k++) {
+            if (w[k] < w[a]) {
+                b = a;
+                a = k;
+            } else if (w[k] < w[b]) {
+                b = k;
+            }
+        }
+        w[a] += w[b];
+        total += w[a];
+        w[b] = w[--n];
+    }
+    return total;
+}
+
+// --bench: text and rANS coding of the method 3 symbols, best of 3 runs
+// Throughput is MB of int16 coefficients per second. There is no Huffman
+// coder in this tree, so its row is the size of an optimal per-image Huffman
+// code for the same symbols plus extra bits (code tables not counted).
+void entropy_bench(const CoefPlane *plane) {
+    CoefPlane check;
+    if (coef_plane_init(&check, plane->blocks_x * 8, plane->blocks_y * 8, plane->channels)) return;
+    
+    double best[4] = {1e30, 1e30, 1e30, 1e30};     // text enc / dec, rANS enc / dec
+    long size[2] = {0, 0};
+    uint64_t huffman = 0;
+    int mismatch = 0;
+    
+    for (int run = 0; run < 3; run++) {
+        double t[4] = {0, 0, 0, 0};
+        size[0] = size[1] = 0;
+        
+        for (int ch = 0; ch < plane->channels; ch++) {
+            for (int f = 0; f < 2; f++) {
+                FILE *fdc = tmpfile();
+                FILE *fac = tmpfile();
+                if (!fdc || !fac) {
+                    fprintf(stderr, "Error creating benchmark files\n");
+                    coef_plane_free(&check);
+                    return;
+                }
+                
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (f == 0) entropy_code_channel(plane, ch, fdc, fac);
+                else rans_code_channel(plane, ch, fdc, fac);
+                fflush(fdc);
+                fflush(fac);
+                t[2 * f] += elapsed_usec(&start);
+                size[f] += ftell(fdc) + ftell(fac);
+                
+                rewind(fdc);
+                rewind(fac);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (read_entropy_channel(&check, ch, fdc, fac)) mismatch = 1;
+                t[2 * f + 1] += elapsed_usec(&start);
+                if (memcmp(coef_block(&check, ch, 0), coef_block(plane, ch, 0),
+                           (size_t)plane->blocks * 64 * sizeof(int16_t)) != 0) {
+                    mismatch = 1;
+                }
+                
+                fclose(fdc);
+                fclose(fac);
+            }
+        }
+        for (int k = 0; k < 4; k++) {
+            if (t[k] < best[k]) best[k] = t[k];
+        }
+    }
+    
+    for (int ch = 0; ch < plane->channels; ch++) {
+        SymbolBuffer sb[2];
+        if (collect_symbols(plane, ch, &sb[0], &sb[1]) == 0) {
+            for (int k = 0; k < 2; k++) {
+                uint32_t count[256] = {0};
+                for (size_t i = 0; i < sb[k].count; i++) count[sb[k].syms[i]]++;
+                huffman += huffman_bits(count) + sb[k].bit_bytes * 8 + sb[k].acc_bits;
+            }
+        }
+        symbols_free(&sb[0]);
+        symbols_free(&sb[1]);
+    }
+    coef_plane_free(&check);
+    
+    double mb = (double)plane->channels * plane->blocks * 64 * sizeof(int16_t) / 1e6;
+    printf("Entropy coding benchmark: %d blocks x %d channels, %.2f MB of coefficients\n",
+           plane->blocks, plane->channels, mb);
+    printf("  text     %10ld bytes  encode %8.1f MB/s  decode %8.1f MB/s\n",
+           size[0], mb / (best[0] / 1e6), mb / (best[1] / 1e6));
+    printf("  rans     %10ld bytes  encode %8.1f MB/s  decode %8.1f MB/s\n",
+           size[1], mb / (best[2] / 1e6), mb / (best[3] / 1e6));
+    printf("  huffman  %10llu bytes  (size estimate)\n", (unsigned long long)((huffman + 7) / 8));
+    if (mismatch) fprintf(stderr, "Entropy coding benchmark: decoded coefficients do not match\n");
+}
+
+// Output quantization tables
+int write_qtables(const char *path_y, const char *path_cb, const char *path_cr) {
+    FILE *fqty = fopen(path_y, "w");
+    FILE *fqtcb = fopen(path_cb, "w");
+    FILE *fqtcr = fopen(path_cr, "w");
     
     if (!fqty || !fqtcb || !fqtcr) {
         fprintf(stderr, "Error opening quantization table files\n");
@@ -187,99 +517,610 @@ int method_1_encoder(int argc, char *argv[]) {
     fclose(fqty); 
     fclose(fqtcb); 
     fclose(fqtcr);
+    return 0;
+}
+
+// Reader thread callback: one strip of up to 8 pixel rows
+typedef struct {
+    BmpReader *br;
+} EncoderStripSource;
+
+int fill_pixel_strip(void *ctx, int index, void *buf) {
+    BmpReader *br = ((EncoderStripSource *)ctx)->br;
+    int first = index * 8;
+    int count = (br->height - first < 8) ? br->height - first : 8;
     
-    // Output dimensions
-    FILE *fdim = fopen(argv[6], "w");
-    fprintf(fdim, "%d %d\n", width, height);
-    fclose(fdim);
+    Pixel *rows[8];
+    for (int i = 0; i < count; i++) rows[i] = (Pixel *)buf + (size_t)i * br->width;
+    return bmp_read_rows(br, first, count, rows);
+}
+
+// Method 1, pipelined: the reader thread prefetches the next pixel strips
+// and the writer thread drains finished coefficient strips with one large
+// write per stream, so I/O overlaps with the DCT on the main thread.
+int method_1_encoder_pipelined(int argc, char *argv[]) {
+    BmpReader br;
+    if (bmp_open(&br, argv[2])) return 1;
     
-    // Open output files for quantized coefficients
-    FILE *fqfy = fopen(argv[7], "wb");
-    FILE *fqfcb = fopen(argv[8], "wb");
-    FILE *fqfcr = fopen(argv[9], "wb");
-    FILE *fefy = fopen(argv[10], "wb");
-    FILE *fefcb = fopen(argv[11], "wb");
-    FILE *fefcr = fopen(argv[12], "wb");
-    
-    if (!fqfy || !fqfcb || !fqfcr || !fefy || !fefcb || !fefcr) {
-        fprintf(stderr, "Error opening coefficient files\n");
+    // Same Y-only decision as the plain path, made in the single pass: all
+    // three channels are written, and for a gray image (whose Cb / Cr blocks
+    // are all zero) the Cb / Cr outputs are dropped at the end
+    int width = br.width, height = br.height;
+    int nc = 3, gray = 1;
+    
+    if (write_qtables(argv[3], argv[4], argv[5])) return 1;
+    
+    FILE *fqf[3], *fef[3];
+    char *iobuf[6];
+    for (int ch = 0; ch < nc; ch++) {
+        fqf[ch] = fopen(argv[7 + ch], "wb");
+        fef[ch] = fopen(argv[10 + ch], "wb");
+        if (!fqf[ch] || !fef[ch]) {
+            fprintf(stderr, "Error opening coefficient files\n");
+            return 1;
+        }
+        iobuf[2 * ch] = pipeline_iobuf(fqf[ch]);
+        iobuf[2 * ch + 1] = pipeline_iobuf(fef[ch]);
+    }
+    
+    int blocks_x = (width + 7) / 8;
+    int blocks_y = (height + 7) / 8;
+    size_t channel_bytes = (size_t)blocks_x * 64 * sizeof(int16_t);
+    
+    BlockCache *cache = block_cache_new();
+    EncoderStripSource src = { &br };
+    StripReader reader;
+    StripWriter writer;
+    if (strip_reader_start(&reader, (size_t)8 * width * sizeof(Pixel), blocks_y, fill_pixel_strip, &src) ||
+        strip_writer_start(&writer, nc * channel_bytes)) {
         return 1;
     }
     
-    // Process each 8x8 block
-    for (int by = 0; by < height; by += 8) {
-        for (int bx = 0; bx < width; bx += 8) {
-            double ycbcr_y[8][8], ycbcr_cb[8][8], ycbcr_cr[8][8];
-            
-            // Convert to YCbCr and level shift - FIX #3: All components get level shift
-            for (int i = 0; i < 8; i++) {
-                for (int j = 0; j < 8; j++) {
-                    int py = by + i;
-                    int px = bx + j;
-                    
-                    if (py >= height) py = height - 1;
-                    if (px >= width) px = width - 1;
-                    
-                    double y, cb, cr;
-                    rgb_to_ycbcr(pixels[py][px], &y, &cb, &cr);
-                    
-                    // Level shift all components to -128...127 range
-                    ycbcr_y[i][j] = y - 128.0;
-                    ycbcr_cb[i][j] = cb - 128.0;      // FIX: Now cb has +128 from rgb_to_ycbcr
-                    ycbcr_cr[i][j] = cr - 128.0;
-                }
+    int err = 0;
+    for (int s = 0; s < blocks_y; s++) {
+        Pixel *strip = (Pixel *)strip_reader_next(&reader, s);
+        if (!strip) {
+            err = 1;
+            break;
+        }
+        
+        Pixel *rows[8];
+        int count = (height - s * 8 < 8) ? height - s * 8 : 8;
+        for (int i = 0; i < count; i++) rows[i] = strip + (size_t)i * width;
+        if (gray) gray = is_grayscale(rows, width, count);
+        
+        // Transform straight into the writer's buffer
+        WriteJob *job = strip_writer_acquire(&writer);
+        CoefPlane plane;
+        coef_plane_wrap(&plane, job->buf, blocks_x, 1, nc);
+        transform_blocks(rows, width, count, &plane, 0, blocks_x, cache);
+        strip_reader_release(&reader);
+        zigzag_blocks(&plane, 0, blocks_x);
+        
+        for (int ch = 0; ch < nc; ch++) {
+            write_job_add(job, fqf[ch], -1, ch * channel_bytes, channel_bytes);
+            write_job_add(job, fef[ch], -1, ch * channel_bytes, channel_bytes);
+        }
+        strip_writer_submit(&writer);
+    }
+    
+    if (strip_reader_finish(&reader)) err = 1;
+    if (strip_writer_finish(&writer)) {
+        fprintf(stderr, "Error writing coefficient data\n");
+        err = 1;
+    }
+    
+    for (int ch = 0; ch < nc; ch++) {
+        fclose(fqf[ch]);
+        fclose(fef[ch]);
+        free(iobuf[2 * ch]);
+        free(iobuf[2 * ch + 1]);
+    }
+    bmp_close(&br);
+    if (err) return 1;
+    
+    if (gray) {
+        nc = 1;
+        for (int ch = 1; ch < 3; ch++) {
+            remove(argv[7 + ch]);
+            remove(argv[10 + ch]);
+        }
+    }
+    if (write_dim(argv[6], width, height, nc)) return 1;
+    
+    block_cache_report(cache);
+    free(cache);
+    printf("Method 1 Encoder Complete (pipelined%s)\n", nc == 1 ? ", grayscale, Y only" : "");
+    return 0;
+}
+
+// Scratch memory needed by encode_stream
+size_t encode_scratch_size(int width, int nc) {
+    size_t blocks_x = (width + 7) / 8;
+    return nc * blocks_x * 64 * sizeof(int16_t) + (size_t)8 * width * sizeof(Pixel) + sizeof(BlockCache);
+}
+
+// Encode a BMP into the framed coefficient stream (coef.h), one block row at a time
+// Block rows are emitted in file order (bottom row first for bottom-up files),
+// so the input is read strictly forward and may be a pipe
+// `scratch` must be COEF_ALIGN aligned and hold encode_scratch_size() bytes
+int encode_stream(BmpReader *br, int nc, FILE *out, void *scratch) {
+    int width = br->width, height = br->height;
+    int blocks_x = (width + 7) / 8;
+    int blocks_y = (height + 7) / 8;
+    
+    StreamHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = STREAM_MAGIC;
+    h.version = STREAM_VERSION;
+    h.channels = nc;
+    h.width = width;
+    h.height = height;
+    for (int i = 0; i < 64; i++) {
+        h.qtable[0][i] = std_qtable_Y[i / 8][i % 8];
+        h.qtable[1][i] = std_qtable_C[i / 8][i % 8];
+        h.qtable[2][i] = std_qtable_C[i / 8][i % 8];
+    }
+    if (fwrite(&h, sizeof(h), 1, out) != 1) {
+        fprintf(stderr, "Error writing coefficient stream\n");
+        return 1;
+    }
+    
+    CoefPlane plane;
+    coef_plane_wrap(&plane, scratch, blocks_x, 1, nc);
+    Pixel *strip = (Pixel *)(plane.data + (size_t)nc * blocks_x * 64);
+    BlockCache *cache = (BlockCache *)(strip + (size_t)8 * width);
+    memset(cache, 0, sizeof(BlockCache));
+    
+    for (int k = 0; k < blocks_y; k++) {
+        int s = br->bottom_up ? blocks_y - 1 - k : k;
+        Pixel *rows[8];
+        int count = (height - s * 8 < 8) ? height - s * 8 : 8;
+        for (int i = 0; i < count; i++) rows[i] = strip + (size_t)i * width;
+        
+        if (bmp_read_rows(br, s * 8, count, rows)) return 1;
+        transform_blocks(rows, width, count, &plane, 0, blocks_x, cache);
+        zigzag_blocks(&plane, 0, blocks_x);
+        if (stream_write_strip(out, s, &plane)) return 1;
+    }
+    return 0;
+}
+
+// Server: response size bound for an ENCODE request (BMP payload)
+// Rejects a header whose pixel rows are not all in the payload
+size_t encode_response_size(uint32_t type, const char *payload, size_t len) {
+    if (type != REQ_ENCODE || len < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)) return 0;
+    
+    BITMAPFILEHEADER fh;
+    BITMAPINFOHEADER ih;
+    memcpy(&fh, payload, sizeof(fh));
+    memcpy(&ih, payload + sizeof(BITMAPFILEHEADER), sizeof(ih));
+    if (ih.biWidth <= 0 || ih.biHeight == 0 || ih.biBitCount == 0 || fh.bfOffBits > len) return 0;
+    
+    uint64_t stride = ((uint64_t)ih.biWidth * ih.biBitCount + 31) / 32 * 4;
+    uint64_t height = (ih.biHeight < 0) ? -(int64_t)ih.biHeight : ih.biHeight;
+    if (height > (len - fh.bfOffBits) / stride) return 0;
+    return stream_size(ih.biWidth, (int)height, 3);
+}
+
+// Server: ENCODE request handler
+int serve_encode(ServerWorker *w, uint32_t type, FILE *in, FILE *out, size_t *out_len) {
+    BmpReader br;
+    if (bmp_open_fp(&br, in)) return 1;
+    
+    // The payload is in memory, so the extra gray scan is cheap
+    int nc = bmp_scan_gray(&br) ? 1 : 3;
+    void *scratch = server_scratch(w, encode_scratch_size(br.width, nc));
+    int err = !scratch || encode_stream(&br, nc, out, scratch);
+    *out_len = stream_size(br.width, br.height, nc);
+    
+    bmp_release(&br);
+    return err;
+}
+
+// Pipe mode: stdin is read once, front to back, and memory stays at one strip
+int pipe_encode(void) {
+    // Buffers go in before the first read; static, since stdout is flushed at exit
+    static char inbuf[PIPELINE_IOBUF], outbuf[PIPELINE_IOBUF];
+    setvbuf(stdin, inbuf, _IOFBF, PIPELINE_IOBUF);
+    setvbuf(stdout, outbuf, _IOFBF, PIPELINE_IOBUF);
+    
+    BmpReader br;
+    if (bmp_open_fp(&br, stdin)) return 1;
+    
+    // Rows cannot be scanned twice, so only a gray palette selects Y-only coding
+    int nc = (br.bpp == 8 && br.gray_palette) ? 1 : 3;
+    size_t size = (encode_scratch_size(br.width, nc) + COEF_ALIGN - 1) / COEF_ALIGN * COEF_ALIGN;
+    void *scratch = aligned_alloc(COEF_ALIGN, size);
+    
+    int err = !scratch || encode_stream(&br, nc, stdout, scratch) || fflush(stdout) != 0;
+    if (err) fprintf(stderr, "Pipe encode failed\n");
+    
+    free(scratch);
+    bmp_release(&br);
+    return err;
+}
+
+// Incremental re-encode
+//
+// Unchanged blocks are detected by comparing pixel rows with the previous
+// BMP (--prev) or with per-block hashes saved by the previous run (--hash).
+// Their coefficients are copied from the previous outputs, which are read
+// before being overwritten.
+//
+// Both modes only trust outputs they can identify. The hash file, and for
+// --prev a "<dim>.sig" file next to the outputs, are written after every
+// output has been closed; their header names the method, the size and
+// checksum of the coefficient files and the hash of the encoded image. If
+// the outputs changed since (another method, another image, an interrupted
+// run) or, for --prev, were not produced from that BMP, every block is
+// encoded again.
+#define HASH_MAGIC 0x48534D4D   // "MMSH"
+#define HASH_VERSION 3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t method;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    uint64_t outputs_size;
+    uint64_t outputs_hash;
+    uint64_t image_hash;
+} HashHeader;
+
+// FNV-1a over the in-image part of a block
+uint64_t block_hash(Pixel **pixels, int width, int height, int bx, int by) {
+    int rows = (height - by < 8) ? height - by : 8;
+    int cols = (width - bx < 8) ? width - bx : 8;
+    uint64_t h = FNV_OFFSET;
+    for (int i = 0; i < rows; i++) {
+        h = fnv1a(h, &pixels[by + i][bx], cols * sizeof(Pixel));
+    }
+    return h;
+}
+
+// FNV-1a over all pixels of an image
+uint64_t image_hash(Pixel **pixels, int width, int height) {
+    uint64_t h = FNV_OFFSET;
+    for (int i = 0; i < height; i++) h = fnv1a(h, pixels[i], width * sizeof(Pixel));
+    return h;
+}
+
+int same_block(Pixel **a, Pixel **b, int width, int height, int bx, int by) {
+    int rows = (height - by < 8) ? height - by : 8;
+    int cols = (width - bx < 8) ? width - bx : 8;
+    for (int i = 0; i < rows; i++) {
+        if (memcmp(&a[by + i][bx], &b[by + i][bx], cols * sizeof(Pixel)) != 0) return 0;
+    }
+    return 1;
+}
+
+// Coefficient files an incremental run reads back: dim plus the qF_* files
+// (method 1) or the DC_* / AC_* files (method 3)
+int prev_output_files(int method, int nc, char *argv[], const char *files[7]) {
+    int n = 0;
+    if (method == 1) {
+        files[n++] = argv[6];
+        for (int ch = 0; ch < nc; ch++) files[n++] = argv[7 + ch];
+    } else {
+        files[n++] = argv[9];
+        for (int ch = 0; ch < nc; ch++) {
+            files[n++] = argv[3 + ch];
+            files[n++] = argv[6 + ch];
+        }
+    }
+    return n;
+}
+
+// Total size and FNV-1a checksum of those files; non-zero if one is missing
+int output_signature(int method, int nc, char *argv[], uint64_t *size, uint64_t *hash) {
+    const char *files[7];
+    int n = prev_output_files(method, nc, argv, files);
+    
+    *size = 0;
+    *hash = FNV_OFFSET;
+    char buf[1 << 16];
+    for (int k = 0; k < n; k++) {
+        FILE *fp = fopen(files[k], "rb");
+        if (!fp) return 1;
+        size_t got;
+        while ((got = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            *hash = fnv1a(*hash, buf, got);
+            *size += got;
+        }
+        fclose(fp);
+    }
+    return 0;
+}
+
+// Reads the header of a hash / signature file and checks it against the
+// current image layout and the outputs on disk; returns the open file
+// positioned after the header, or NULL if the saved state is unusable
+FILE *open_incremental_state(const char *path, HashHeader *hdr, int method, int width, int height,
+                             int nc, char *argv[]) {
+    FILE *fp = fopen(path, "rb");
+    uint64_t size, sum;
+    if (fp && fread(hdr, sizeof(*hdr), 1, fp) == 1 &&
+        hdr->magic == HASH_MAGIC && hdr->version == HASH_VERSION && hdr->method == method &&
+        hdr->width == width && hdr->height == height && hdr->channels == nc &&
+        output_signature(method, nc, argv, &size, &sum) == 0 &&
+        hdr->outputs_size == size && hdr->outputs_hash == sum) {
+        return fp;
+    }
+    if (fp) fclose(fp);
+    return NULL;
+}
+
+// The --prev signature file lives next to the dim output
+char *prev_sig_path(int method, char *argv[]) {
+    const char *dim = argv[method == 1 ? 6 : 9];
+    char *path = (char *)malloc(strlen(dim) + 5);
+    sprintf(path, "%s.sig", dim);
+    return path;
+}
+
+// Per-block change map (1 = recompute), or NULL if every block must be recomputed
+// With --hash, the new block hashes are returned in `hashes` for write_incremental_state
+unsigned char *find_changed_blocks(Pixel **pixels, int width, int height, const CoefPlane *plane,
+                                   int method, char *argv[], uint64_t **hashes_out) {
+    unsigned char *changed = NULL;
+    uint64_t *hashes = NULL;
+    
+    if (opt_hash) {
+        hashes = (uint64_t *)malloc(plane->blocks * sizeof(uint64_t));
+        for (int b = 0; b < plane->blocks; b++) {
+            hashes[b] = block_hash(pixels, width, height, (b % plane->blocks_x) * 8, (b / plane->blocks_x) * 8);
+        }
+    }
+    
+    if (opt_prev) {
+        // The outputs on disk must have been produced from the --prev image
+        int pw, ph;
+        Pixel **prev = read_bmp(opt_prev, &pw, &ph);
+        char *sig = prev_sig_path(method, argv);
+        HashHeader hdr;
+        FILE *fs = prev ? open_incremental_state(sig, &hdr, method, width, height, plane->channels, argv) : NULL;
+        if (fs) fclose(fs);
+        free(sig);
+        if (fs && pw == width && ph == height && hdr.image_hash == image_hash(prev, pw, ph)) {
+            changed = (unsigned char *)malloc(plane->blocks);
+            for (int b = 0; b < plane->blocks; b++) {
+                changed[b] = !same_block(pixels, prev, width, height, (b % plane->blocks_x) * 8, (b / plane->blocks_x) * 8);
             }
-            
-            // DCT
-            double dct_y[8][8], dct_cb[8][8], dct_cr[8][8];
-            perform_dct(ycbcr_y, dct_y);
-            perform_dct(ycbcr_cb, dct_cb);
-            perform_dct(ycbcr_cr, dct_cr);
-            
-            // Quantization (2D result)
-            short q_y[8][8], q_cb[8][8], q_cr[8][8];
-            for (int u = 0; u < 8; u++) {
-                for (int v = 0; v < 8; v++) {
-                    q_y[u][v] = (short)round(dct_y[u][v] / std_qtable_Y[u][v]);
-                    q_cb[u][v] = (short)round(dct_cb[u][v] / std_qtable_C[u][v]);
-                    q_cr[u][v] = (short)round(dct_cr[u][v] / std_qtable_C[u][v]);
-                }
+        }
+        if (prev) {
+            for (int i = 0; i < ph; i++) free(prev[i]);
+            free(prev);
+        }
+    } else if (opt_hash) {
+        // The saved hashes are only trusted for the exact outputs they were written with
+        HashHeader hdr;
+        FILE *fh = open_incremental_state(opt_hash, &hdr, method, width, height, plane->channels, argv);
+        if (fh) {
+            uint64_t *old = (uint64_t *)malloc(plane->blocks * sizeof(uint64_t));
+            if (fread(old, sizeof(uint64_t), plane->blocks, fh) == (size_t)plane->blocks) {
+                changed = (unsigned char *)malloc(plane->blocks);
+                for (int b = 0; b < plane->blocks; b++) changed[b] = (old[b] != hashes[b]);
             }
-            
-            // Convert to zig-zag order (1D array)
-            short zz_q_y[64], zz_q_cb[64], zz_q_cr[64];
-            for (int i = 0; i < 64; i++) {
-                int zz_pos = zigzag_order[i];  // Position in 2D
-                int u = zz_pos / 8;
-                int v = zz_pos % 8;
-                zz_q_y[i] = q_y[u][v];
-                zz_q_cb[i] = q_cb[u][v];
-                zz_q_cr[i] = q_cr[u][v];
+            free(old);
+            fclose(fh);
+        }
+    }
+    
+    *hashes_out = hashes;
+    if (!changed) printf("Incremental: no usable previous image, encoding every block\n");
+    return changed;
+}
+
+// Save the signature of the outputs just written (and with --hash the block
+// hashes); call only after every output file has been closed
+void write_incremental_state(int method, int nc, char *argv[], Pixel **pixels, int width, int height,
+                             const uint64_t *hashes, int blocks) {
+    HashHeader hdr = { HASH_MAGIC, HASH_VERSION, method, width, height, nc, 0, 0, 0 };
+    if (output_signature(method, nc, argv, &hdr.outputs_size, &hdr.outputs_hash)) {
+        fprintf(stderr, "Error reading outputs for the incremental state\n");
+        return;
+    }
+    hdr.image_hash = image_hash(pixels, width, height);
+    
+    if (opt_prev) {
+        char *sig = prev_sig_path(method, argv);
+        FILE *fs = fopen(sig, "wb");
+        if (!fs || fwrite(&hdr, sizeof(hdr), 1, fs) != 1) {
+            fprintf(stderr, "Error writing signature file: %s\n", sig);
+        }
+        if (fs) fclose(fs);
+        free(sig);
+    }
+    if (opt_hash) {
+        FILE *fh = fopen(opt_hash, "wb");
+        if (!fh || fwrite(&hdr, sizeof(hdr), 1, fh) != 1 ||
+            fwrite(hashes, sizeof(uint64_t), blocks, fh) != (size_t)blocks) {
+            fprintf(stderr, "Error writing block hash file: %s\n", opt_hash);
+        }
+        if (fh) fclose(fh);
+    }
+}
+
+// Checks that the previous dim file describes the same image layout
+int prev_dim_matches(const char *path, int width, int height, int nc) {
+    int w, h, c;
+    return read_dim(path, &w, &h, &c) == 0 && w == width && h == height && c == nc;
+}
+
+// Previous method 1 output: raw zig-zag coefficients
+int load_prev_raw(char *argv[], CoefPlane *prev) {
+    for (int ch = 0; ch < prev->channels; ch++) {
+        FILE *fp = fopen(argv[7 + ch], "rb");
+        if (!fp) return 1;
+        int err = read_coef_channel(prev, ch, fp);
+        fclose(fp);
+        if (err) return 1;
+    }
+    return 0;
+}
+
+// Previous method 3 output: DPCM / RLE text or rANS streams
+int load_prev_text(char *argv[], CoefPlane *prev) {
+    for (int ch = 0; ch < prev->channels; ch++) {
+        FILE *fdc = fopen(argv[3 + ch], "rb");
+        FILE *fac = fopen(argv[6 + ch], "rb");
+        int err = !fdc || !fac || read_entropy_channel(prev, ch, fdc, fac);
+        if (fdc) fclose(fdc);
+        if (fac) fclose(fac);
+        if (err) return 1;
+    }
+    return 0;
+}
+
+// Transform + zig-zag stages; with a change map, unchanged blocks are copied
+// from `prev` instead of being recomputed
+void encode_blocks(Pixel **pixels, int width, int height, CoefPlane *plane,
+                   const CoefPlane *prev, const unsigned char *changed, BlockCache *cache) {
+    if (!changed) {
+        transform_blocks(pixels, width, height, plane, 0, plane->blocks, cache);
+        zigzag_blocks(plane, 0, plane->blocks);
+        return;
+    }
+    
+    int recomputed = 0;
+    for (int b = 0; b < plane->blocks; b++) {
+        if (changed[b]) {
+            transform_blocks(pixels, width, height, plane, b, b + 1, cache);
+            zigzag_blocks(plane, b, b + 1);
+            recomputed++;
+        } else {
+            for (int ch = 0; ch < plane->channels; ch++) {
+                memcpy(coef_block(plane, ch, b), coef_block(prev, ch, b), 64 * sizeof(int16_t));
             }
-            
-            // Write quantized coefficients
-            fwrite(zz_q_y, sizeof(short), 64, fqfy);
-            fwrite(zz_q_cb, sizeof(short), 64, fqfcb);
-            fwrite(zz_q_cr, sizeof(short), 64, fqfcr);
-            
-            // Write unquantized (for error analysis)
-            fwrite(zz_q_y, sizeof(short), 64, fefy);
-            fwrite(zz_q_cb, sizeof(short), 64, fefcb);
-            fwrite(zz_q_cr, sizeof(short), 64, fefcr);
+        }
+    }
+    printf("Incremental: recomputed %d of %d blocks\n", recomputed, plane->blocks);
+}
+
+// Read the input image, or with --rows only the requested stripe of block rows
+// A stripe is encoded as a standalone image (DPCM restarts at its first block);
+// ./merge joins the partial outputs back into a single-process result
+Pixel **read_input(const char *filename, int *width, int *height) {
+    if (!opt_rows) return read_bmp(filename, width, height);
+    
+    BmpReader br;
+    if (bmp_open(&br, filename)) return NULL;
+    
+    int blocks_y = (br.height + 7) / 8;
+    int last = (opt_row_last < blocks_y) ? opt_row_last : blocks_y;
+    if (opt_row_first < 0 || opt_row_first >= last) {
+        fprintf(stderr, "Invalid block row range %d:%d (image has %d block rows)\n",
+                opt_row_first, opt_row_last, blocks_y);
+        bmp_close(&br);
+        return NULL;
+    }
+    
+    int first_row = opt_row_first * 8;
+    int end_row = (last * 8 < br.height) ? last * 8 : br.height;
+    *width = br.width;
+    *height = end_row - first_row;
+    
+    Pixel **pixels = (Pixel **)malloc(*height * sizeof(Pixel *));
+    for (int i = 0; i < *height; i++) {
+        pixels[i] = (Pixel *)malloc(*width * sizeof(Pixel));
+    }
+    
+    // Seeks straight to the stripe, the rest of the file is never read
+    if (bmp_read_rows(&br, first_row, *height, pixels)) {
+        for (int i = 0; i < *height; i++) free(pixels[i]);
+        free(pixels);
+        bmp_close(&br);
+        return NULL;
+    }
+    bmp_close(&br);
+    
+    printf("Stripe: block rows %d to %d of %d\n", opt_row_first, last, blocks_y);
+    return pixels;
+}
+
+// Method 1: DCT + Quantization
+int method_1_encoder(int argc, char *argv[]) {
+    if (argc < 13) {
+        fprintf(stderr, "Usage: encoder 1 <bmp> <Qt_Y> <Qt_Cb> <Qt_Cr> <dim> <qF_Y.raw> <qF_Cb.raw> <qF_Cr.raw> <eF_Y.raw> <eF_Cb.raw> <eF_Cr.raw>\n");
+        return 1;
+    }
+    
+    int incremental = (opt_prev || opt_hash);
+    if (opt_pipeline) return method_1_encoder_pipelined(argc, argv);
+    
+    int width, height;
+    Pixel **pixels = read_input(argv[2], &width, &height);
+    if (!pixels) return 1;
+    
+    // Grayscale input: only the Y channel is coded
+    int nc = is_grayscale(pixels, width, height) ? 1 : 3;
+    
+    CoefPlane plane, prev;
+    if (coef_plane_init(&plane, width, height, nc)) return 1;
+    
+    // Previous coefficients must be loaded before the outputs are truncated
+    unsigned char *changed = NULL;
+    uint64_t *hashes = NULL;
+    if (incremental) {
+        changed = find_changed_blocks(pixels, width, height, &plane, 1, argv, &hashes);
+        if (changed && (!prev_dim_matches(argv[6], width, height, nc) ||
+                        coef_plane_init(&prev, width, height, nc) || load_prev_raw(argv, &prev))) {
+            printf("Incremental: previous coefficients unusable, encoding every block\n");
+            free(changed);
+            changed = NULL;
+        }
+    }
+    
+    if (write_qtables(argv[3], argv[4], argv[5]) || write_dim(argv[6], width, height, nc)) {
+        return 1;
+    }
+    
+    // Open output files for quantized coefficients
+    FILE *fqf[3], *fef[3];
+    for (int ch = 0; ch < nc; ch++) {
+        fqf[ch] = fopen(argv[7 + ch], "wb");
+        fef[ch] = fopen(argv[10 + ch], "wb");
+        if (!fqf[ch] || !fef[ch]) {
+            fprintf(stderr, "Error opening coefficient files\n");
+            return 1;
+        }
+    }
+    
+    // Transform and zig-zag stages over the whole coefficient plane
+    BlockCache *cache = block_cache_new();
+    encode_blocks(pixels, width, height, &plane, &prev, changed, cache);
+    if (changed) {
+        coef_plane_free(&prev);
+        free(changed);
+    }
+    
+    // Write quantized coefficients, and unquantized (for error analysis)
+    for (int ch = 0; ch < nc; ch++) {
+        if (write_coef_channel(&plane, ch, fqf[ch]) ||
+            write_coef_channel(&plane, ch, fef[ch])) {
+            return 1;
         }
     }
     
-    fclose(fqfy); 
-    fclose(fqfcb); 
-    fclose(fqfcr);
-    fclose(fefy); 
-    fclose(fefcb); 
-    fclose(fefcr);
+    for (int ch = 0; ch < nc; ch++) {
+        fclose(fqf[ch]);
+        fclose(fef[ch]);
+    }
+    if (opt_prev || opt_hash) {
+        write_incremental_state(1, nc, argv, pixels, width, height, hashes, plane.blocks);
+        free(hashes);
+    }
     
+    coef_plane_free(&plane);
     for (int i = 0; i < height; i++) free(pixels[i]);
     free(pixels);
     
-    printf("Method 1 Encoder Complete\n");
+    block_cache_report(cache);
+    free(cache);
+    printf("Method 1 Encoder Complete%s\n", nc == 1 ? " (grayscale, Y only)" : "");
     return 0;
 }
 
@@ -291,141 +1132,159 @@ int method_3_encoder(int argc, char *argv[]) {
     }
     
     int width, height;
-    Pixel **pixels = read_bmp(argv[2], &width, &height);
+    Pixel **pixels = read_input(argv[2], &width, &height);
     if (!pixels) return 1;
     
-    FILE *fdc_y = fopen(argv[3], "w");
-    FILE *fdc_cb = fopen(argv[4], "w");
-    FILE *fdc_cr = fopen(argv[5], "w");
-    FILE *fac_y = fopen(argv[6], "w");
-    FILE *fac_cb = fopen(argv[7], "w");
-    FILE *fac_cr = fopen(argv[8], "w");
+    // Grayscale input: only the Y channel is coded
+    int nc = is_grayscale(pixels, width, height) ? 1 : 3;
     
-    if (!fdc_y || !fdc_cb || !fdc_cr || !fac_y || !fac_cb || !fac_cr) {
-        fprintf(stderr, "Error opening entropy coding output files\n");
-        return 1;
+    CoefPlane plane, prev;
+    if (coef_plane_init(&plane, width, height, nc)) return 1;
+    
+    // Previous coefficients must be loaded before the outputs are truncated;
+    // the DPCM chain is rebuilt from the merged plane, so it stays consistent
+    unsigned char *changed = NULL;
+    uint64_t *hashes = NULL;
+    if (opt_prev || opt_hash) {
+        changed = find_changed_blocks(pixels, width, height, &plane, 3, argv, &hashes);
+        if (changed && (!prev_dim_matches(argv[9], width, height, nc) ||
+                        coef_plane_init(&prev, width, height, nc) || load_prev_text(argv, &prev))) {
+            printf("Incremental: previous coefficients unusable, encoding every block\n");
+            free(changed);
+            changed = NULL;
+        }
+    }
+    
+    FILE *fdc[3], *fac[3];
+    for (int ch = 0; ch < nc; ch++) {
+        fdc[ch] = fopen(argv[3 + ch], opt_rans ? "wb" : "w");
+        fac[ch] = fopen(argv[6 + ch], opt_rans ? "wb" : "w");
+        if (!fdc[ch] || !fac[ch]) {
+            fprintf(stderr, "Error opening entropy coding output files\n");
+            return 1;
+        }
     }
     
     // Output dimensions
-    FILE *fdim = fopen(argv[9], "w");
-    fprintf(fdim, "%d %d\n", width, height);
-    fclose(fdim);
+    if (write_dim(argv[9], width, height, nc)) return 1;
     
-    int last_dc_y = 0, last_dc_cb = 0, last_dc_cr = 0;
+    // Transform and zig-zag stages over the whole coefficient plane
+    BlockCache *cache = block_cache_new();
+    encode_blocks(pixels, width, height, &plane, &prev, changed, cache);
+    if (changed) {
+        coef_plane_free(&prev);
+        free(changed);
+    }
     
-    // Process each 8x8 block
-    for (int by = 0; by < height; by += 8) {
-        for (int bx = 0; bx < width; bx += 8) {
-            double ycbcr_y[8][8], ycbcr_cb[8][8], ycbcr_cr[8][8];
-            
-            // Convert to YCbCr and level shift
-            for (int i = 0; i < 8; i++) {
-                for (int j = 0; j < 8; j++) {
-                    int py = by + i;
-                    int px = bx + j;
-                    
-                    if (py >= height) py = height - 1;
-                    if (px >= width) px = width - 1;
-                    
-                    double y, cb, cr;
-                    rgb_to_ycbcr(pixels[py][px], &y, &cb, &cr);
-                    
-                    ycbcr_y[i][j] = y - 128.0;
-                    ycbcr_cb[i][j] = cb - 128.0;
-                    ycbcr_cr[i][j] = cr - 128.0;
-                }
-            }
-            
-            // DCT
-            double dct_y[8][8], dct_cb[8][8], dct_cr[8][8];
-            perform_dct(ycbcr_y, dct_y);
-            perform_dct(ycbcr_cb, dct_cb);
-            perform_dct(ycbcr_cr, dct_cr);
-            
-            // Quantization (2D result)
-            short q_y[8][8], q_cb[8][8], q_cr[8][8];
-            for (int u = 0; u < 8; u++) {
-                for (int v = 0; v < 8; v++) {
-                    q_y[u][v] = (short)round(dct_y[u][v] / std_qtable_Y[u][v]);
-                    q_cb[u][v] = (short)round(dct_cb[u][v] / std_qtable_C[u][v]);
-                    q_cr[u][v] = (short)round(dct_cr[u][v] / std_qtable_C[u][v]);
-                }
-            }
-            
-            // DC DPCM
-            short dc_diff_y = q_y[0][0] - last_dc_y;
-            short dc_diff_cb = q_cb[0][0] - last_dc_cb;
-            short dc_diff_cr = q_cr[0][0] - last_dc_cr;
-            
-            fprintf(fdc_y, "%d ", dc_diff_y);
-            fprintf(fdc_cb, "%d ", dc_diff_cb);
-            fprintf(fdc_cr, "%d ", dc_diff_cr);
-            
-            last_dc_y = q_y[0][0];
-            last_dc_cb = q_cb[0][0];
-            last_dc_cr = q_cr[0][0];
-            
-            // Convert to zig-zag order
-            short zz_q_y[64], zz_q_cb[64], zz_q_cr[64];
-            for (int i = 0; i < 64; i++) {
-                int zz_pos = zigzag_order[i];
-                int u = zz_pos / 8;
-                int v = zz_pos % 8;
-                zz_q_y[i] = q_y[u][v];
-                zz_q_cb[i] = q_cb[u][v];
-                zz_q_cr[i] = q_cr[u][v];
-            }
-            
-            // AC RLE (skip DC which is at position 0)
-            FILE *fac_files[3] = {fac_y, fac_cb, fac_cr};
-            short *zz_arrays[3] = {zz_q_y, zz_q_cb, zz_q_cr};
-            
-            for (int ch = 0; ch < 3; ch++) {
-                int run_length = 0;
-                for (int i = 1; i < 64; i++) {
-                    if (zz_arrays[ch][i] == 0) {
-                        run_length++;
-                    } else {
-                        while (run_length > 15) {
-                            fprintf(fac_files[ch], "(15,0) ");
-                            run_length -= 16;
-                        }
-                        fprintf(fac_files[ch], "(%d,%d) ", run_length, zz_arrays[ch][i]);
-                        run_length = 0;
-                    }
-                }
-                // EOB
-                fprintf(fac_files[ch], "(0,0) ");
-            }
-            
-            fprintf(fac_y, "\n");
-            fprintf(fac_cb, "\n");
-            fprintf(fac_cr, "\n");
+    // Entropy coding stage, one channel at a time
+    for (int ch = 0; ch < nc; ch++) {
+        if (opt_rans) {
+            if (rans_code_channel(&plane, ch, fdc[ch], fac[ch])) return 1;
+        } else {
+            entropy_code_channel(&plane, ch, fdc[ch], fac[ch]);
         }
     }
+    if (opt_bench) entropy_bench(&plane);
     
-    fclose(fdc_y); 
-    fclose(fdc_cb); 
-    fclose(fdc_cr);
-    fclose(fac_y); 
-    fclose(fac_cb); 
-    fclose(fac_cr);
+    for (int ch = 0; ch < nc; ch++) {
+        fclose(fdc[ch]);
+        fclose(fac[ch]);
+    }
+    if (opt_prev || opt_hash) {
+        write_incremental_state(3, nc, argv, pixels, width, height, hashes, plane.blocks);
+        free(hashes);
+    }
     
+    coef_plane_free(&plane);
     for (int i = 0; i < height; i++) free(pixels[i]);
     free(pixels);
     
-    printf("Method 3 Encoder Complete\n");
+    block_cache_report(cache);
+    free(cache);
+    printf("Method 3 Encoder Complete%s%s\n", opt_rans ? " (rANS)" : "", nc == 1 ? " (grayscale, Y only)" : "");
     return 0;
 }
 
+// Option combinations that would otherwise be silently ignored (a stripe
+// job that encodes the whole image, say); method is -1 for --serve / --pipe
+const char *unsupported_options(int method) {
+    if (method < 0 && (opt_pipeline || opt_prev || opt_hash || opt_rows || opt_rans || opt_bench)) {
+        return "--serve and --pipe take no other options than --threads";
+    }
+    if (opt_pipeline && method != 1) return "--pipeline is only supported by method 1";
+    if (opt_pipeline && (opt_rows || opt_prev || opt_hash)) {
+        return "--pipeline cannot be combined with --rows, --prev or --hash";
+    }
+    if ((opt_rows || opt_prev || opt_hash) && method != 1 && method != 3) {
+        return "--rows, --prev and --hash are only supported by methods 1 and 3";
+    }
+    if (opt_rows && opt_prev) return "--prev cannot be combined with --rows";
+    // rANS streams are only written by method 3, and merge cannot join them
+    if (opt_rans && method != 3) return "--rans is only supported by method 3";
+    if (opt_rans && opt_rows) return "--rans cannot be combined with --rows";
+    if (opt_bench && method != 3) return "--bench is only supported by method 3";
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
+    // Leading options, e.g. ./encoder --pipeline 1 ...
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        int used = 1;
+        if (strcmp(argv[1], "--pipeline") == 0) {
+            opt_pipeline = 1;
+        } else if (strcmp(argv[1], "--serve") == 0 && argc > 2) {
+            opt_serve = argv[2];
+            used = 2;
+        } else if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+            opt_threads = atoi(argv[2]);
+            used = 2;
+        } else if (strcmp(argv[1], "--prev") == 0 && argc > 2) {
+            opt_prev = argv[2];
+            used = 2;
+        } else if (strcmp(argv[1], "--hash") == 0 && argc > 2) {
+            opt_hash = argv[2];
+            used = 2;
+        } else if (strcmp(argv[1], "--pipe") == 0) {
+            opt_pipe = 1;
+        } else if (strcmp(argv[1], "--rans") == 0) {
+            opt_rans = 1;
+        } else if (strcmp(argv[1], "--bench") == 0) {
+            opt_bench = 1;
+        } else if (strcmp(argv[1], "--rows") == 0 && argc > 2 &&
+                   sscanf(argv[2], "%d:%d", &opt_row_first, &opt_row_last) == 2) {
+            opt_rows = 1;
+            used = 2;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[1]);
+            return 1;
+        }
+        argv += used;
+        argc -= used;
+    }
+    
+    const char *bad = NULL;
+    if (opt_serve || opt_pipe) bad = unsupported_options(-1);
+    else if (argc >= 2) bad = unsupported_options(atoi(argv[1]));
+    if (bad) {
+        fprintf(stderr, "%s\n", bad);
+        return 1;
+    }
+    
+    if (opt_serve) {
+        int threads = opt_threads > 0 ? opt_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return run_server(opt_serve, threads, serve_encode, encode_response_size);
+    }
+    
+    if (opt_pipe) return pipe_encode();
+    
     if (argc < 2) {
-        fprintf(stderr, "Usage: ./encoder <method> ...\n");
+        fprintf(stderr, "Usage: ./encoder [--pipeline] [--prev <old.bmp>] [--hash <blocks.hash>] [--rows <first>:<last>] [--rans] [--bench] <0|1|3> ...\n");
+        fprintf(stderr, "       ./encoder --serve <socket> [--threads <n>]\n");
+        fprintf(stderr, "       ./encoder --pipe < in.bmp > out.stream\n");
         return 1;
     }
     
     int method = atoi(argv[1]);
-    
     switch (method) {
         case 0:
             return method_0_encoder(argc, argv);
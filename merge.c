@@ -0,0 +1,240 @@
+#include "rans.h"
+
+// Merge stripes encoded with ./encoder --rows <first>:<last> back into the
+// output of a single-process run.
+//
+//   merge 1 <n> <10 output files> <10 files of stripe 1> ... <stripe n>
+//       file order as for encoder 1: Qt_Y Qt_Cb Qt_Cr dim qF_Y qF_Cb qF_Cr eF_Y eF_Cb eF_Cr
+//   merge 3 <n> <7 output files> <7 files of stripe 1> ... <stripe n>
+//       file order as for encoder 3: DC_Y DC_Cb DC_Cr AC_Y AC_Cb AC_Cr dim
+//
+// Stripes are given top to bottom. A grayscale stripe (Y only) inside a color
+// image gets all-zero Cb / Cr blocks, which is what a full encode produces
+// for gray pixels. rANS stripes (encoder --rans) are not supported.
+// If merging fails, the partly written outputs are removed.
+
+typedef struct {
+    int width;
+    int height;
+    int nc;
+    int blocks;
+} Part;
+
+int read_part(const char *path, Part *part) {
+    if (read_dim(path, &part->width, &part->height, &part->nc)) return 1;
+    part->blocks = ((part->width + 7) / 8) * ((part->height + 7) / 8);
+    return 0;
+}
+
+// Checks that the stripes line up and returns the merged image description
+int check_parts(Part *parts, int n, Part *merged) {
+    merged->width = parts[0].width;
+    merged->height = 0;
+    merged->nc = 1;
+    merged->blocks = 0;
+
+    for (int k = 0; k < n; k++) {
+        if (parts[k].width != merged->width) {
+            fprintf(stderr, "Stripe %d has a different width\n", k + 1);
+            return 1;
+        }
+        if (k < n - 1 && parts[k].height % 8 != 0) {
+            fprintf(stderr, "Stripe %d does not end on a block row\n", k + 1);
+            return 1;
+        }
+        merged->height += parts[k].height;
+        merged->blocks += parts[k].blocks;
+        if (parts[k].nc == 3) merged->nc = 3;
+    }
+    return 0;
+}
+
+// Append `src` to `dst`; if expected >= 0 the file must have exactly that size
+int append_file(FILE *dst, const char *src, long expected) {
+    FILE *fp = fopen(src, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error opening file: %s\n", src);
+        return 1;
+    }
+
+    char buf[1 << 16];
+    long total = 0;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (fwrite(buf, 1, n, dst) != n) {
+            fprintf(stderr, "Error writing merged output\n");
+            fclose(fp);
+            return 1;
+        }
+        total += n;
+    }
+    fclose(fp);
+
+    if (expected >= 0 && total != expected) {
+        fprintf(stderr, "Unexpected size of %s: %ld bytes, expected %ld\n", src, total, expected);
+        return 1;
+    }
+    return 0;
+}
+
+// Method 1 stripes: raw coefficient streams are simply concatenated
+int merge_method_1(int n, char *out[], char **in) {
+    Part parts[n], merged;
+    for (int k = 0; k < n; k++) {
+        if (read_part(in[k * 10 + 3], &parts[k])) return 1;
+    }
+    if (check_parts(parts, n, &merged)) return 1;
+
+    // Quantization tables are the same for every stripe
+    for (int t = 0; t < 3; t++) {
+        FILE *fp = fopen(out[t], "w");
+        if (!fp) {
+            fprintf(stderr, "Error opening file: %s\n", out[t]);
+            return 1;
+        }
+        int err = append_file(fp, in[t], -1);
+        fclose(fp);
+        if (err) return 1;
+    }
+    if (write_dim(out[3], merged.width, merged.height, merged.nc)) return 1;
+
+    static const short zero_block[64];
+    for (int ch = 0; ch < merged.nc; ch++) {
+        // qF_* at offset 4, eF_* at offset 7
+        for (int f = 4; f <= 7; f += 3) {
+            FILE *fp = fopen(out[f + ch], "wb");
+            if (!fp) {
+                fprintf(stderr, "Error opening coefficient files\n");
+                return 1;
+            }
+            for (int k = 0; k < n; k++) {
+                if (ch < parts[k].nc) {
+                    if (append_file(fp, in[k * 10 + f + ch], (long)parts[k].blocks * 64 * sizeof(short))) {
+                        fclose(fp);
+                        return 1;
+                    }
+                } else {
+                    for (int b = 0; b < parts[k].blocks; b++) fwrite(zero_block, sizeof(short), 64, fp);
+                }
+            }
+            fclose(fp);
+        }
+    }
+
+    printf("Merged %d stripes: %d x %d, %d blocks\n", n, merged.width, merged.height, merged.blocks);
+    return 0;
+}
+
+// Undo each stripe's DC DPCM into dc[] and append its AC stream to `fac`
+int merge_channel_3(int n, const Part *parts, int ch, char **in, short *dc, FILE *fac) {
+    int pos = 0;
+    for (int k = 0; k < n; k++) {
+        if (ch >= parts[k].nc) {
+            // Gray stripe: zero Cb / Cr blocks, DC 0 and an immediate EOB
+            for (int b = 0; b < parts[k].blocks; b++) {
+                dc[pos++] = 0;
+                fprintf(fac, "(0,0) \n");
+            }
+            continue;
+        }
+
+        // Undo the stripe's own DPCM
+        FILE *fp = fopen(in[k * 7 + ch], "rb");
+        if (!fp) {
+            fprintf(stderr, "Error opening file: %s\n", in[k * 7 + ch]);
+            return 1;
+        }
+        uint32_t magic;
+        if (fread(&magic, sizeof(magic), 1, fp) == 1 && magic == RANS_MAGIC) {
+            fprintf(stderr, "Cannot merge rANS stripes (encoder --rans): %s\n", in[k * 7 + ch]);
+            fclose(fp);
+            return 1;
+        }
+        rewind(fp);
+        short last_dc = 0;
+        for (int b = 0; b < parts[k].blocks; b++) {
+            int diff;
+            if (fscanf(fp, "%d", &diff) != 1) {
+                fprintf(stderr, "Error reading DC coefficients: %s\n", in[k * 7 + ch]);
+                fclose(fp);
+                return 1;
+            }
+            last_dc = (short)(last_dc + diff);
+            dc[pos++] = last_dc;
+        }
+        fclose(fp);
+
+        if (append_file(fac, in[k * 7 + 3 + ch], -1)) return 1;
+    }
+    return 0;
+}
+
+// Method 3 stripes: AC streams are concatenated; every stripe restarts its
+// DC DPCM at zero, so DC differences are re-derived across the seams
+int merge_method_3(int n, char *out[], char **in) {
+    Part parts[n], merged;
+    for (int k = 0; k < n; k++) {
+        if (read_part(in[k * 7 + 6], &parts[k])) return 1;
+    }
+    if (check_parts(parts, n, &merged)) return 1;
+    if (write_dim(out[6], merged.width, merged.height, merged.nc)) return 1;
+
+    short *dc = (short *)malloc(merged.blocks * sizeof(short));
+
+    for (int ch = 0; ch < merged.nc; ch++) {
+        FILE *fdc = fopen(out[ch], "w");
+        FILE *fac = fopen(out[3 + ch], "w");
+        if (!fdc || !fac || merge_channel_3(n, parts, ch, in, dc, fac)) {
+            if (!fdc || !fac) fprintf(stderr, "Error opening entropy coding output files\n");
+            if (fdc) fclose(fdc);
+            if (fac) fclose(fac);
+            free(dc);
+            return 1;
+        }
+
+        // DC DPCM over the whole image
+        short last_dc = 0;
+        for (int b = 0; b < merged.blocks; b++) {
+            short dc_diff = dc[b] - last_dc;
+            fprintf(fdc, "%d ", dc_diff);
+            last_dc = dc[b];
+        }
+
+        fclose(fdc);
+        fclose(fac);
+    }
+
+    free(dc);
+    printf("Merged %d stripes: %d x %d, %d blocks\n", n, merged.width, merged.height, merged.blocks);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: ./merge <1|3> <stripes> <output files> <stripe files> ...\n");
+        return 1;
+    }
+
+    int method = atoi(argv[1]);
+    int n = atoi(argv[2]);
+    int files = (method == 1) ? 10 : (method == 3) ? 7 : 0;
+
+    if (files == 0) {
+        fprintf(stderr, "Unknown method: %d\n", method);
+        return 1;
+    }
+    if (n < 1 || argc != 3 + files * (n + 1)) {
+        fprintf(stderr, "Expected %d output files and %d files per stripe\n", files, files);
+        return 1;
+    }
+
+    char **out = argv + 3;
+    char **in = argv + 3 + files;
+    int err = (method == 1) ? merge_method_1(n, out, in) : merge_method_3(n, out, in);
+
+    // Do not leave a partial merge behind that looks like a complete one
+    if (err) {
+        for (int f = 0; f < files; f++) remove(out[f]);
+    }
+    return err;
+}
@@ -0,0 +1,241 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include "coef.h"
+
+// Strip pipeline: a reader thread prefetches input strips into a ring of
+// buffers while a writer thread drains finished strips to the output files,
+// so file I/O overlaps with the transform work on the main thread.
+#define PIPELINE_SLOTS 3
+#define PIPELINE_IOBUF (1 << 20)
+#define WRITE_TARGETS 6
+
+// Fills `buf` with input strip `index`; returns non-zero on error
+typedef int (*strip_fill_fn)(void *ctx, int index, void *buf);
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void *slots[PIPELINE_SLOTS];
+    int count;          // total number of strips
+    int filled;         // strips read so far
+    int consumed;       // strips released by the consumer
+    int error;
+    int stop;
+    strip_fill_fn fill;
+    void *ctx;
+} StripReader;
+
+void *strip_reader_main(void *arg) {
+    StripReader *r = (StripReader *)arg;
+
+    for (int i = 0; i < r->count; i++) {
+        pthread_mutex_lock(&r->lock);
+        while (r->filled - r->consumed >= PIPELINE_SLOTS && !r->stop) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        int stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop) break;
+
+        int err = r->fill(r->ctx, i, r->slots[i % PIPELINE_SLOTS]);
+
+        pthread_mutex_lock(&r->lock);
+        if (err) r->error = 1;
+        else r->filled++;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        if (err) break;
+    }
+    return NULL;
+}
+
+// Gives `fp` a PIPELINE_IOBUF stdio buffer; must be called before the first
+// read or write on the stream. Free the returned buffer after fclose.
+char *pipeline_iobuf(FILE *fp) {
+    char *buf = (char *)malloc(PIPELINE_IOBUF);
+    if (buf && setvbuf(fp, buf, _IOFBF, PIPELINE_IOBUF) != 0) {
+        free(buf);
+        buf = NULL;
+    }
+    return buf;
+}
+
+int strip_reader_start(StripReader *r, size_t slot_size, int count, strip_fill_fn fill, void *ctx) {
+    memset(r, 0, sizeof(*r));
+    r->count = count;
+    r->fill = fill;
+    r->ctx = ctx;
+
+    size_t bytes = (slot_size + COEF_ALIGN - 1) / COEF_ALIGN * COEF_ALIGN;
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        r->slots[i] = aligned_alloc(COEF_ALIGN, bytes);
+        if (!r->slots[i]) {
+            fprintf(stderr, "Error allocating reader buffers\n");
+            return 1;
+        }
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, strip_reader_main, r) != 0) {
+        fprintf(stderr, "Error starting reader thread\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Blocks until strip `index` is available; NULL if the reader failed
+void *strip_reader_next(StripReader *r, int index) {
+    pthread_mutex_lock(&r->lock);
+    while (r->filled <= index && !r->error) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    void *buf = (r->filled > index) ? r->slots[index % PIPELINE_SLOTS] : NULL;
+    pthread_mutex_unlock(&r->lock);
+    return buf;
+}
+
+// Hands the oldest strip buffer back to the reader
+void strip_reader_release(StripReader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->consumed++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+int strip_reader_finish(StripReader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    for (int i = 0; i < PIPELINE_SLOTS; i++) free(r->slots[i]);
+    return r->error;
+}
+
+// One region of a job buffer destined for one file
+// offset < 0 appends at the current position, otherwise seeks first
+typedef struct {
+    FILE *fp;
+    long offset;
+    size_t start;
+    size_t len;
+} WriteTarget;
+
+typedef struct {
+    void *buf;
+    int ntargets;
+    WriteTarget targets[WRITE_TARGETS];
+} WriteJob;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    WriteJob jobs[PIPELINE_SLOTS];
+    int submitted;
+    int written;
+    int error;
+    int done;
+} StripWriter;
+
+void *strip_writer_main(void *arg) {
+    StripWriter *w = (StripWriter *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->written == w->submitted && !w->done) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->written == w->submitted) break;
+
+        WriteJob *job = &w->jobs[w->written % PIPELINE_SLOTS];
+        pthread_mutex_unlock(&w->lock);
+
+        int err = 0;
+        for (int t = 0; t < job->ntargets; t++) {
+            WriteTarget *tg = &job->targets[t];
+            if (tg->offset >= 0 && fseek(tg->fp, tg->offset, SEEK_SET) != 0) err = 1;
+            if (fwrite((char *)job->buf + tg->start, 1, tg->len, tg->fp) != tg->len) err = 1;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (err) w->error = 1;
+        w->written++;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+int strip_writer_start(StripWriter *w, size_t slot_size) {
+    memset(w, 0, sizeof(*w));
+
+    size_t bytes = (slot_size + COEF_ALIGN - 1) / COEF_ALIGN * COEF_ALIGN;
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        w->jobs[i].buf = aligned_alloc(COEF_ALIGN, bytes);
+        if (!w->jobs[i].buf) {
+            fprintf(stderr, "Error allocating writer buffers\n");
+            return 1;
+        }
+        memset(w->jobs[i].buf, 0, bytes);
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, strip_writer_main, w) != 0) {
+        fprintf(stderr, "Error starting writer thread\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Blocks until a job buffer is free; the caller fills it and submits it
+WriteJob *strip_writer_acquire(StripWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->submitted - w->written >= PIPELINE_SLOTS) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    WriteJob *job = &w->jobs[w->submitted % PIPELINE_SLOTS];
+    pthread_mutex_unlock(&w->lock);
+
+    job->ntargets = 0;
+    return job;
+}
+
+void write_job_add(WriteJob *job, FILE *fp, long offset, size_t start, size_t len) {
+    WriteTarget *tg = &job->targets[job->ntargets++];
+    tg->fp = fp;
+    tg->offset = offset;
+    tg->start = start;
+    tg->len = len;
+}
+
+void strip_writer_submit(StripWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    w->submitted++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Drains all pending jobs and stops the writer thread
+int strip_writer_finish(StripWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    w->done = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    for (int i = 0; i < PIPELINE_SLOTS; i++) free(w->jobs[i].buf);
+    return w->error;
+}
+
+#endif
@@ -0,0 +1,369 @@
+#ifndef RANS_H
+#define RANS_H
+
+#include "coef.h"
+
+// rANS backend for the method 3 symbols (./encoder --rans 3 ...)
+//
+// DC differences and AC (run,value) pairs are mapped to JPEG-style symbols:
+// DC symbol = size category of the difference, AC symbol = run << 4 | size
+// (0x00 = EOB, 0xF0 = 16 zeros). The `size` low bits of each value follow as
+// raw extra bits. Symbols are coded with a static per-stream frequency table
+// and RANS_STATES interleaved 32-bit rANS states; symbol i uses state i % 4,
+// so consecutive symbols have no data dependency in either direction.
+//
+// File layout (one file per DC / AC stream and channel):
+//   header:  magic "MMSA", uint32 symbols, uint32 rans_bytes, uint32 bit_bytes,
+//            uint16 table entries
+//   table:   (uint8 symbol, uint16 frequency) per entry, frequencies sum to RANS_SCALE
+//   data:    rans_bytes of rANS output (initial states first), then bit_bytes
+//            of extra bits, MSB first
+#define RANS_MAGIC 0x41534D4D   // "MMSA"
+#define RANS_SCALE_BITS 12
+#define RANS_SCALE (1u << RANS_SCALE_BITS)
+#define RANS_L (1u << 23)       // lower bound of the normalized state interval
+#define RANS_STATES 4
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t symbols;
+    uint32_t rans_bytes;
+    uint32_t bit_bytes;
+    uint16_t entries;
+} RansHeader;
+
+typedef struct {
+    uint8_t symbol;
+    uint16_t freq;
+} RansEntry;
+#pragma pack(pop)
+
+// Symbols and extra bits of one stream, collected before coding
+typedef struct {
+    uint8_t *syms;
+    size_t count;
+    size_t cap;
+    uint8_t *bits;
+    size_t bit_bytes;
+    size_t bit_cap;
+    uint64_t acc;
+    int acc_bits;
+} SymbolBuffer;
+
+// Decoded stream: all symbols up front, extra bits read while rebuilding blocks
+typedef struct {
+    uint8_t *data;          // whole file after the header
+    uint8_t *syms;
+    size_t count;
+    const uint8_t *bits;
+    const uint8_t *bits_end;
+    uint64_t acc;
+    int acc_bits;
+    int overrun;            // extra bits were read past bits_end
+} RansStream;
+
+// Number of bits needed for |v| (JPEG size category)
+int value_size(int v) {
+    unsigned a = (v < 0) ? -v : v;
+    return a ? 32 - __builtin_clz(a) : 0;
+}
+
+// Low `size` bits sent for v; negative values are stored as v - 1 (JPEG)
+uint32_t value_bits(int v, int size) {
+    return (uint32_t)(v < 0 ? v - 1 : v) & ((1u << size) - 1);
+}
+
+int extend_value(uint32_t bits, int size) {
+    if (size == 0) return 0;
+    return (bits < (1u << (size - 1))) ? (int)bits - (1 << size) + 1 : (int)bits;
+}
+
+void symbols_init(SymbolBuffer *sb) {
+    memset(sb, 0, sizeof(*sb));
+}
+
+void symbols_free(SymbolBuffer *sb) {
+    free(sb->syms);
+    free(sb->bits);
+    memset(sb, 0, sizeof(*sb));
+}
+
+void symbols_put(SymbolBuffer *sb, uint8_t sym, uint32_t bits, int size) {
+    if (sb->count == sb->cap) {
+        sb->cap = sb->cap ? sb->cap * 2 : 4096;
+        sb->syms = (uint8_t *)realloc(sb->syms, sb->cap);
+    }
+    sb->syms[sb->count++] = sym;
+
+    if (sb->bit_bytes + 8 > sb->bit_cap) {
+        sb->bit_cap = sb->bit_cap ? sb->bit_cap * 2 : 4096;
+        sb->bits = (uint8_t *)realloc(sb->bits, sb->bit_cap);
+    }
+    sb->acc = (sb->acc << size) | bits;
+    sb->acc_bits += size;
+    while (sb->acc_bits >= 8) {
+        sb->acc_bits -= 8;
+        sb->bits[sb->bit_bytes++] = (uint8_t)(sb->acc >> sb->acc_bits);
+    }
+}
+
+// Scale symbol counts to frequencies summing to RANS_SCALE, every used symbol >= 1
+void rans_normalize(const uint32_t count[256], uint16_t freq[256]) {
+    uint64_t total = 0;
+    for (int s = 0; s < 256; s++) total += count[s];
+
+    int sum = 0, largest = 0;
+    for (int s = 0; s < 256; s++) {
+        freq[s] = 0;
+        if (count[s] == 0) continue;
+        uint64_t f = count[s] * (uint64_t)RANS_SCALE / total;
+        freq[s] = f ? (uint16_t)f : 1;
+        sum += freq[s];
+        if (count[s] > count[largest]) largest = s;
+    }
+
+    // Rounding error goes to the most frequent symbol while it can absorb it,
+    // otherwise it is spread over the other symbols that are above 1
+    if (sum == 0) return;
+    int diff = (int)RANS_SCALE - sum;
+    if (diff > 0 || freq[largest] + diff >= 1) {
+        freq[largest] += diff;
+        return;
+    }
+    for (int s = 0; s < 256 && sum > (int)RANS_SCALE; s++) {
+        while (freq[s] > 1 && sum > (int)RANS_SCALE) {
+            freq[s]--;
+            sum--;
+        }
+    }
+}
+
+// Code the collected symbols and write one stream file; returns bytes written, 0 on error
+size_t rans_write_stream(const SymbolBuffer *sb, FILE *fp) {
+    uint32_t count[256] = {0};
+    for (size_t i = 0; i < sb->count; i++) count[sb->syms[i]]++;
+
+    uint16_t freq[256];
+    uint32_t start[256];
+    rans_normalize(count, freq);
+    RansEntry table[256];
+    int entries = 0;
+    uint32_t cum = 0;
+    for (int s = 0; s < 256; s++) {
+        start[s] = cum;
+        cum += freq[s];
+        if (freq[s]) {
+            table[entries].symbol = (uint8_t)s;
+            table[entries].freq = freq[s];
+            entries++;
+        }
+    }
+
+    // At most two renormalization bytes per symbol, plus the final states
+    size_t cap = sb->count * 2 + RANS_STATES * 4;
+    uint8_t *buf = (uint8_t *)malloc(cap);
+    uint8_t *ptr = buf + cap;
+    uint32_t x[RANS_STATES];
+    for (int k = 0; k < RANS_STATES; k++) x[k] = RANS_L;
+
+    // rANS is LIFO: encode backwards so the decoder runs forwards
+    for (size_t i = sb->count; i-- > 0;) {
+        uint32_t *st = &x[i % RANS_STATES];
+        int s = sb->syms[i];
+        uint32_t f = freq[s];
+        uint32_t x_max = ((RANS_L >> RANS_SCALE_BITS) << 8) * f;
+        while (*st >= x_max) {
+            *--ptr = (uint8_t)*st;
+            *st >>= 8;
+        }
+        *st = ((*st / f) << RANS_SCALE_BITS) + (*st % f) + start[s];
+    }
+    for (int k = RANS_STATES - 1; k >= 0; k--) {
+        ptr -= 4;
+        ptr[0] = (uint8_t)x[k];
+        ptr[1] = (uint8_t)(x[k] >> 8);
+        ptr[2] = (uint8_t)(x[k] >> 16);
+        ptr[3] = (uint8_t)(x[k] >> 24);
+    }
+
+    // Pending extra bits are padded with zeros to a whole byte
+    uint8_t tail = 0;
+    size_t bit_bytes = sb->bit_bytes;
+    if (sb->acc_bits > 0) {
+        tail = (uint8_t)(sb->acc << (8 - sb->acc_bits));
+        bit_bytes++;
+    }
+
+    RansHeader h = { RANS_MAGIC, (uint32_t)sb->count, (uint32_t)(buf + cap - ptr), (uint32_t)bit_bytes, (uint16_t)entries };
+    int err = fwrite(&h, sizeof(h), 1, fp) != 1 ||
+              fwrite(table, sizeof(RansEntry), entries, fp) != (size_t)entries ||
+              fwrite(ptr, 1, h.rans_bytes, fp) != h.rans_bytes ||
+              fwrite(sb->bits, 1, sb->bit_bytes, fp) != sb->bit_bytes ||
+              (sb->acc_bits > 0 && fputc(tail, fp) == EOF);
+    free(buf);
+    if (err) {
+        fprintf(stderr, "Error writing rANS stream\n");
+        return 0;
+    }
+    return sizeof(h) + entries * sizeof(RansEntry) + h.rans_bytes + bit_bytes;
+}
+
+// Read one stream file and decode all of its symbols
+int rans_read_stream(FILE *fp, RansStream *rs) {
+    memset(rs, 0, sizeof(*rs));
+
+    RansHeader h;
+    RansEntry table[256];
+    if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != RANS_MAGIC || h.entries > 256 ||
+        h.rans_bytes < RANS_STATES * 4 ||
+        fread(table, sizeof(RansEntry), h.entries, fp) != h.entries) {
+        fprintf(stderr, "Error reading rANS stream header\n");
+        return 1;
+    }
+
+    // Slot -> symbol lookup over the cumulative frequencies
+    uint16_t freq[256] = {0};
+    uint16_t start[256] = {0};
+    uint8_t lookup[RANS_SCALE];
+    uint32_t cum = 0;
+    for (int e = 0; e < h.entries; e++) {
+        int s = table[e].symbol;
+        if (cum + table[e].freq > RANS_SCALE) break;
+        freq[s] = table[e].freq;
+        start[s] = (uint16_t)cum;
+        memset(lookup + cum, s, table[e].freq);
+        cum += table[e].freq;
+    }
+    if (cum != RANS_SCALE && h.symbols > 0) {
+        fprintf(stderr, "Corrupt rANS frequency table\n");
+        return 1;
+    }
+
+    size_t size = (size_t)h.rans_bytes + h.bit_bytes;
+    rs->data = (uint8_t *)malloc(size + 1);
+    rs->syms = (uint8_t *)malloc(h.symbols + 1);
+    if (!rs->data || !rs->syms || fread(rs->data, 1, size, fp) != size) {
+        fprintf(stderr, "Error reading rANS stream\n");
+        return 1;
+    }
+    rs->count = h.symbols;
+    rs->bits = rs->data + h.rans_bytes;
+    rs->bits_end = rs->bits + h.bit_bytes;
+
+    const uint8_t *ptr = rs->data;
+    const uint8_t *end = rs->data + h.rans_bytes;
+    uint32_t x[RANS_STATES];
+    for (int k = 0; k < RANS_STATES; k++) {
+        x[k] = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+        ptr += 4;
+    }
+
+    // Symbol i only touches state i % 4, so the four decode chains overlap
+    for (size_t i = 0; i < rs->count; i++) {
+        uint32_t *st = &x[i % RANS_STATES];
+        uint32_t slot = *st & (RANS_SCALE - 1);
+        int s = lookup[slot];
+        rs->syms[i] = (uint8_t)s;
+        *st = freq[s] * (*st >> RANS_SCALE_BITS) + slot - start[s];
+        while (*st < RANS_L && ptr < end) *st = (*st << 8) | *ptr++;
+    }
+    return 0;
+}
+
+uint32_t rans_get_bits(RansStream *rs, int size) {
+    while (rs->acc_bits < size) {
+        if (rs->bits < rs->bits_end) {
+            rs->acc = (rs->acc << 8) | *rs->bits++;
+        } else {
+            rs->acc <<= 8;
+            rs->overrun = 1;
+        }
+        rs->acc_bits += 8;
+    }
+    rs->acc_bits -= size;
+    return (uint32_t)(rs->acc >> rs->acc_bits) & ((1u << size) - 1);
+}
+
+void rans_stream_free(RansStream *rs) {
+    free(rs->data);
+    free(rs->syms);
+}
+
+// Rebuild one zig-zag ordered channel from the rANS DC / AC streams
+int read_rans_channel(CoefPlane *plane, int ch, FILE *fdc, FILE *fac) {
+    RansStream dc, ac;
+    memset(&ac, 0, sizeof(ac));
+    int err = rans_read_stream(fdc, &dc) || rans_read_stream(fac, &ac);
+    if (!err && dc.count != (size_t)plane->blocks) {
+        fprintf(stderr, "DC stream has %zu symbols, expected %d\n", dc.count, plane->blocks);
+        err = 1;
+    }
+
+    short last_dc = 0;
+    size_t k = 0;
+    for (int b = 0; b < plane->blocks && !err; b++) {
+        int16_t *zz = coef_block(plane, ch, b);
+        memset(zz, 0, 64 * sizeof(int16_t));
+
+        // DC DPCM; a difference of two int16 values needs at most 16 bits
+        int size = dc.syms[b];
+        if (size > 16) {
+            fprintf(stderr, "Corrupt DC size %d\n", size);
+            err = 1;
+            break;
+        }
+        last_dc = (short)(last_dc + extend_value(rans_get_bits(&dc, size), size));
+        zz[0] = last_dc;
+
+        // AC run / size symbols, 0xF0 stands for 16 zeros
+        int pos = 1;
+        for (;;) {
+            if (k == ac.count) {
+                fprintf(stderr, "Error reading AC coefficients\n");
+                err = 1;
+                break;
+            }
+            int sym = ac.syms[k++];
+            int run = sym >> 4;
+            size = sym & 15;
+            if (size == 0 && run != 0 && run != 15) {
+                fprintf(stderr, "Corrupt AC symbol 0x%02X\n", sym);
+                err = 1;
+                break;
+            }
+            if (size == 0) {
+                if (run == 0) break;
+                pos += 16;
+                continue;
+            }
+            pos += run;
+            if (pos > 63) {
+                fprintf(stderr, "Corrupt AC run length\n");
+                err = 1;
+                break;
+            }
+            zz[pos++] = (int16_t)extend_value(rans_get_bits(&ac, size), size);
+        }
+    }
+
+    if (!err && (dc.overrun || ac.overrun)) {
+        fprintf(stderr, "rANS stream truncated: extra bits missing\n");
+        err = 1;
+    }
+
+    rans_stream_free(&dc);
+    rans_stream_free(&ac);
+    return err;
+}
+
+// Method 3 streams in either format; rANS files are recognized by their magic
+int read_entropy_channel(CoefPlane *plane, int ch, FILE *fdc, FILE *fac) {
+    uint32_t magic = 0;
+    int is_rans = fread(&magic, sizeof(magic), 1, fdc) == 1 && magic == RANS_MAGIC;
+    rewind(fdc);
+    if (is_rans) return read_rans_channel(plane, ch, fdc, fac);
+    return read_dpcm_rle_channel(plane, ch, fdc, fac);
+}
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "coef.h"
+
+// Codec server over a Unix domain socket (./encoder --serve <path>)
+//
+// Every request and response is one frame: a 12-byte header followed by
+// `length` payload bytes. A connection may carry any number of requests.
+//
+//   request:  magic "MMSQ", uint32 type,   uint32 length, payload
+//   response: magic "MMSR", uint32 status, uint32 length, payload
+//
+// ENCODE: payload is a BMP file, response is a coefficient stream (coef.h)
+// DECODE: payload is a coefficient stream, response is a BMP file
+// STATS:  no payload, response is a text line with latency percentiles
+// A non-zero status carries an error message as payload.
+//
+// Workers are assigned per request, not per connection: the acceptor polls
+// every idle connection and queues the ones with a pending request, and the
+// worker hands the connection back after sending the response. Idle
+// keep-alive clients therefore never hold a worker.
+#define SERVER_REQ_MAGIC 0x51534D4D     // "MMSQ"
+#define SERVER_RESP_MAGIC 0x52534D4D    // "MMSR"
+#define SERVER_MAX_PAYLOAD (1u << 30)
+#define SERVER_MAX_RESPONSE (1u << 30)
+#define SERVER_KEEP_BUFFER (64u << 20)  // larger worker buffers are freed after the request
+#define SERVER_RECV_TIMEOUT 10          // seconds a started frame may take to arrive
+#define SERVER_QUEUE 64
+#define SERVER_MAX_CONN 1024
+#define SERVER_SAMPLES 4096
+
+enum { REQ_ENCODE = 1, REQ_DECODE = 2, REQ_STATS = 3 };
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t type;      // request type, or status in a response
+    uint32_t length;
+} FrameHeader;
+#pragma pack(pop)
+
+// Per-worker buffers, grown on demand and kept for the next request
+typedef struct {
+    char *in;
+    size_t in_cap;
+    char *out;
+    size_t out_cap;
+    void *scratch;
+    size_t scratch_cap;
+} ServerWorker;
+
+// Handles one ENCODE / DECODE request; the response goes to `out`
+// (fmemopen over the worker's output buffer) and its size to `out_len`.
+// Returns non-zero on error.
+typedef int (*server_handler_fn)(ServerWorker *w, uint32_t type, FILE *in, FILE *out, size_t *out_len);
+
+// Upper bound of the response size, used to size the output buffer;
+// 0 rejects the request (e.g. a header that does not match the payload).
+// The bound must be checked against the payload, not just taken from the
+// header, so the response and the worker's buffer stay proportional to
+// what the client actually sent.
+typedef size_t (*server_size_fn)(uint32_t type, const char *payload, size_t len);
+
+typedef struct {
+    int listen_fd;
+    server_handler_fn handler;
+    server_size_fn response_size;
+
+    // Connections with a pending request, waiting for a worker
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int queue[SERVER_QUEUE];
+    int head, tail, queued;
+
+    // Connections handed back by the workers; wake_fd interrupts the poll
+    int returned[SERVER_MAX_CONN];
+    int nreturned;
+    int wake_fd[2];
+
+    // Latency of the most recent requests (ring buffer), in microseconds
+    pthread_mutex_t stats_lock;
+    double samples[SERVER_SAMPLES];
+    long long requests;
+    long long errors;
+} Server;
+
+static volatile sig_atomic_t server_stop = 0;
+
+void server_on_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+// Aligned scratch memory reused across requests
+void *server_scratch(ServerWorker *w, size_t size) {
+    if (size > w->scratch_cap) {
+        free(w->scratch);
+        w->scratch_cap = (size + COEF_ALIGN - 1) / COEF_ALIGN * COEF_ALIGN;
+        w->scratch = aligned_alloc(COEF_ALIGN, w->scratch_cap);
+        if (!w->scratch) w->scratch_cap = 0;
+    }
+    return w->scratch;
+}
+
+// Buffers that grew past SERVER_KEEP_BUFFER for one large request are not kept
+void server_trim(ServerWorker *w) {
+    if (w->in_cap > SERVER_KEEP_BUFFER) {
+        free(w->in);
+        w->in = NULL;
+        w->in_cap = 0;
+    }
+    if (w->out_cap > SERVER_KEEP_BUFFER) {
+        free(w->out);
+        w->out = NULL;
+        w->out_cap = 0;
+    }
+    if (w->scratch_cap > SERVER_KEEP_BUFFER) {
+        free(w->scratch);
+        w->scratch = NULL;
+        w->scratch_cap = 0;
+    }
+}
+
+int grow_buffer(char **buf, size_t *cap, size_t size) {
+    if (size <= *cap) return 0;
+    char *p = (char *)realloc(*buf, size);
+    if (!p) return 1;
+    *buf = p;
+    *cap = size;
+    return 0;
+}
+
+int read_full(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int send_response(int fd, uint32_t status, const void *payload, size_t len) {
+    FrameHeader h = { SERVER_RESP_MAGIC, status, (uint32_t)len };
+    if (write_full(fd, &h, sizeof(h))) return 1;
+    return write_full(fd, payload, len);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void server_record(Server *srv, double usec, int failed) {
+    pthread_mutex_lock(&srv->stats_lock);
+    srv->samples[srv->requests % SERVER_SAMPLES] = usec;
+    srv->requests++;
+    if (failed) srv->errors++;
+    pthread_mutex_unlock(&srv->stats_lock);
+}
+
+// "requests N errors E p50_ms .. p90_ms .. p99_ms .. max_ms .."
+int server_stats(Server *srv, char *text, size_t size) {
+    static double sorted[SERVER_SAMPLES];
+    static pthread_mutex_t sort_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&sort_lock);
+    pthread_mutex_lock(&srv->stats_lock);
+    long long requests = srv->requests, errors = srv->errors;
+    int n = requests < SERVER_SAMPLES ? (int)requests : SERVER_SAMPLES;
+    memcpy(sorted, srv->samples, n * sizeof(double));
+    pthread_mutex_unlock(&srv->stats_lock);
+
+    qsort(sorted, n, sizeof(double), compare_double);
+    double p[4] = {0, 0, 0, 0};
+    if (n > 0) {
+        p[0] = sorted[(n - 1) * 50 / 100];
+        p[1] = sorted[(n - 1) * 90 / 100];
+        p[2] = sorted[(n - 1) * 99 / 100];
+        p[3] = sorted[n - 1];
+    }
+    pthread_mutex_unlock(&sort_lock);
+
+    return snprintf(text, size, "requests %lld errors %lld p50_ms %.3f p90_ms %.3f p99_ms %.3f max_ms %.3f\n",
+                    requests, errors, p[0] / 1000.0, p[1] / 1000.0, p[2] / 1000.0, p[3] / 1000.0);
+}
+
+double elapsed_usec(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Serves one request on a connection that has data pending;
+// returns non-zero when the connection should be closed
+int server_request(Server *srv, ServerWorker *w, int fd) {
+    FrameHeader req;
+    if (read_full(fd, &req, sizeof(req))) return 1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (req.magic != SERVER_REQ_MAGIC || req.length > SERVER_MAX_PAYLOAD ||
+        grow_buffer(&w->in, &w->in_cap, req.length + 1) ||
+        read_full(fd, w->in, req.length)) {
+        const char *msg = "bad request frame\n";
+        send_response(fd, 1, msg, strlen(msg));
+        return 1;
+    }
+
+    if (req.type == REQ_STATS) {
+        char text[256];
+        int len = server_stats(srv, text, sizeof(text));
+        return send_response(fd, 0, text, len);
+    }
+
+    // The response is produced into the worker's output buffer
+    size_t bound = srv->response_size(req.type, w->in, req.length);
+    const char *err = NULL;
+    size_t out_len = 0;
+    if (bound == 0 || bound > SERVER_MAX_RESPONSE) {
+        err = "invalid or unsupported request\n";
+    } else if (grow_buffer(&w->out, &w->out_cap, bound + 1)) {
+        err = "out of memory\n";
+    } else {
+        // Cleared so that nothing of the previous response can leak into this one
+        memset(w->out, 0, bound + 1);
+        FILE *in = fmemopen(w->in, req.length, "rb");
+        FILE *out = fmemopen(w->out, bound + 1, "wb");
+        if (!in || !out || srv->handler(w, req.type, in, out, &out_len) || fflush(out) != 0) {
+            err = "request failed\n";
+        }
+        if (in) fclose(in);
+        if (out) fclose(out);
+    }
+
+    int sent = err ? send_response(fd, 1, err, strlen(err))
+                   : send_response(fd, 0, w->out, out_len);
+    server_record(srv, elapsed_usec(&start), err != NULL);
+    server_trim(w);
+    return sent;
+}
+
+// Hands an idle connection back to the acceptor's poll set
+void server_return(Server *srv, int fd) {
+    pthread_mutex_lock(&srv->lock);
+    int full = (srv->nreturned == SERVER_MAX_CONN);
+    if (!full) srv->returned[srv->nreturned++] = fd;
+    pthread_mutex_unlock(&srv->lock);
+
+    if (full) {
+        close(fd);
+        return;
+    }
+    char c = 0;
+    while (write(srv->wake_fd[1], &c, 1) < 0 && errno == EINTR) {}
+}
+
+void *server_worker_main(void *arg) {
+    Server *srv = (Server *)arg;
+    ServerWorker w;
+    memset(&w, 0, sizeof(w));
+
+    for (;;) {
+        pthread_mutex_lock(&srv->lock);
+        while (srv->queued == 0) pthread_cond_wait(&srv->cond, &srv->lock);
+        int fd = srv->queue[srv->head];
+        srv->head = (srv->head + 1) % SERVER_QUEUE;
+        srv->queued--;
+        pthread_cond_broadcast(&srv->cond);
+        pthread_mutex_unlock(&srv->lock);
+
+        if (server_request(srv, &w, fd)) close(fd);
+        else server_return(srv, fd);
+    }
+    return NULL;
+}
+
+// Queues a connection with a pending request for the workers
+void server_enqueue(Server *srv, int fd) {
+    pthread_mutex_lock(&srv->lock);
+    while (srv->queued == SERVER_QUEUE) pthread_cond_wait(&srv->cond, &srv->lock);
+    srv->queue[srv->tail] = fd;
+    srv->tail = (srv->tail + 1) % SERVER_QUEUE;
+    srv->queued++;
+    pthread_cond_broadcast(&srv->cond);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+// Listens on `path` and serves connections on `threads` worker threads
+// until SIGINT / SIGTERM
+int run_server(const char *path, int threads, server_handler_fn handler, server_size_fn response_size) {
+    static Server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.handler = handler;
+    srv.response_size = response_size;
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.cond, NULL);
+    pthread_mutex_init(&srv.stats_lock, NULL);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    srv.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    // Non-blocking: a full pipe already means a wake-up is pending
+    if (pipe(srv.wake_fd) != 0 ||
+        fcntl(srv.wake_fd[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(srv.wake_fd[1], F_SETFL, O_NONBLOCK) != 0) {
+        fprintf(stderr, "Error creating wake-up pipe\n");
+        return 1;
+    }
+    if (srv.listen_fd < 0 ||
+        bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(srv.listen_fd, SERVER_QUEUE) != 0) {
+        fprintf(stderr, "Error listening on socket: %s\n", path);
+        return 1;
+    }
+
+    // poll() returns EINTR on shutdown
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (threads < 1) threads = 1;
+    for (int i = 0; i < threads; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, server_worker_main, &srv) != 0) {
+            fprintf(stderr, "Error starting worker thread\n");
+            return 1;
+        }
+        pthread_detach(t);
+    }
+
+    printf("Listening on %s with %d worker threads\n", path, threads);
+    fflush(stdout);
+
+    // Idle connections, polled together with the listening socket
+    static int idle[SERVER_MAX_CONN];
+    static struct pollfd pfd[SERVER_MAX_CONN + 2];
+    int nidle = 0;
+
+    while (!server_stop) {
+        pfd[0].fd = srv.listen_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = srv.wake_fd[0];
+        pfd[1].events = POLLIN;
+        for (int i = 0; i < nidle; i++) {
+            pfd[2 + i].fd = idle[i];
+            pfd[2 + i].events = POLLIN;
+        }
+        if (poll(pfd, 2 + nidle, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // Connections with a request (or a hangup) go to the workers
+        int kept = 0;
+        for (int i = 0; i < nidle; i++) {
+            if (pfd[2 + i].revents) server_enqueue(&srv, idle[i]);
+            else idle[kept++] = idle[i];
+        }
+        nidle = kept;
+
+        if (pfd[1].revents & POLLIN) {
+            char drain[64];
+            while (read(srv.wake_fd[0], drain, sizeof(drain)) > 0) {}
+        }
+        pthread_mutex_lock(&srv.lock);
+        for (int i = 0; i < srv.nreturned; i++) {
+            if (nidle < SERVER_MAX_CONN) idle[nidle++] = srv.returned[i];
+            else close(srv.returned[i]);
+        }
+        srv.nreturned = 0;
+        pthread_mutex_unlock(&srv.lock);
+
+        if (pfd[0].revents & POLLIN) {
+            int fd = accept(srv.listen_fd, NULL, NULL);
+            if (fd < 0) continue;
+            if (nidle == SERVER_MAX_CONN) {
+                close(fd);
+                continue;
+            }
+            // A client that stalls mid-frame releases its worker after the timeout
+            struct timeval tv = { SERVER_RECV_TIMEOUT, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            idle[nidle++] = fd;
+        }
+    }
+
+    close(srv.listen_fd);
+    unlink(path);
+    printf("Server stopped after %lld requests\n", srv.requests);
+    return 0;
+}
+
+#endif